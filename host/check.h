@@ -0,0 +1,93 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 No0ne (https://github.com/No0ne)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include <stdio.h>
+#include "hal_host.h"
+
+// Helpers for the host checks. Each check program prints what failed
+// and exits non-zero, CTest runs them next to the piosim scripts.
+
+static int check_failures = 0;
+
+#define CHECK(cond, ...) do { \
+  if(!(cond)) { \
+    check_failures++; \
+    fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+    fprintf(stderr, __VA_ARGS__); \
+    fputc('\n', stderr); \
+  } \
+} while(0)
+
+// Advances virtual time in main loop steps
+static inline void check_run_us(u64 us) {
+  for(u64 t = 0; t < us; t += 100) {
+    host_advance_us(100);
+    kb_task();
+    ms_task();
+  }
+}
+
+// PS/2 bytes of a port as one string of hex pairs, for comparing scancodes
+static inline const char* check_bytes(u8 port) {
+  static char text[3 * 256 + 1];
+  u8 buf[256];
+  u16 n = host_ps2_read(port, buf, sizeof(buf));
+  char* end = text;
+  *end = 0;
+  for(u16 i = 0; i < n; i++) end += sprintf(end, i ? " %02x" : "%02x", buf[i]);
+  return text;
+}
+
+// Mouse packets of the 3-byte format, added up
+typedef struct {
+  u16 packets;
+  s32 x;
+  s32 y;
+  u8 buttons; // of the last packet
+  u8 overflow; // of all packets
+  u16 changes; // packets whose buttons differ from the one before
+} check_ms;
+
+static inline check_ms check_ms_read() {
+  static u8 last = 0;
+  check_ms ms = { 0 };
+  u8 buf[3000];
+  u16 n = host_ps2_read(PS2_MS, buf, sizeof(buf));
+  for(u16 i = 0; i + 3 <= n; i += 3) {
+    u8 flags = buf[i];
+    ms.packets++;
+    ms.x += flags & 0x10 ? buf[i + 1] - 256 : buf[i + 1];
+    ms.y += flags & 0x20 ? buf[i + 2] - 256 : buf[i + 2];
+    ms.overflow |= flags & 0xc0;
+    ms.buttons = flags & 7;
+    if(ms.buttons != last) ms.changes++;
+    last = ms.buttons;
+  }
+  return ms;
+}
+
+static inline int check_done(const char* name) {
+  printf("%s: %s\n", name, check_failures ? "FAILED" : "ok");
+  return check_failures ? 1 : 0;
+}
@@ -0,0 +1,197 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 No0ne (https://github.com/No0ne)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "hal_host.h"
+
+#define HOST_BUF 1024
+
+// a byte is 11 bits at roughly 12.5 kHz on the wire
+#define HOST_BYTE_US (11 * 80)
+
+typedef struct {
+  rx_callback rx;
+  u8 buf[HOST_BUF];
+  u16 head;
+  u16 tail;
+  u8 last_rx;
+  u8 last_tx;
+  u64 busy_until; // virtual time the last byte sent is off the wire
+} host_port;
+
+host_port host_ports[2];
+u64 host_now = 0;
+u64 host_alarm = 0;
+u16 host_ps2_capacity = HOST_BUF - 1;
+u32 host_dropped = 0;
+u8 host_leds = 0;
+bool host_trace = true;
+
+void hal_ps2_init(u8 port, u8 gpio_out, u8 gpio_in, rx_callback rx) {
+  (void)gpio_out;
+  (void)gpio_in;
+  memset(&host_ports[port], 0, sizeof(host_port));
+  host_ports[port].rx = rx;
+}
+
+void hal_ps2_send(u8 port, u8 byte) {
+  hal_ps2_send_packet(port, &byte, 1);
+}
+
+bool hal_ps2_send_packet(u8 port, const u8* bytes, u8 len) {
+  if(hal_ps2_room(port) < len) {
+    host_dropped++;
+    return false;
+  }
+
+  host_port* p = &host_ports[port];
+  for(u8 i = 0; i < len; i++) {
+    p->buf[p->head] = bytes[i];
+    p->head = (p->head + 1) % HOST_BUF;
+  }
+  if(p->busy_until < host_now) p->busy_until = host_now;
+  p->busy_until += len * HOST_BYTE_US;
+  return true;
+}
+
+u16 hal_ps2_room(u8 port) {
+  host_port* p = &host_ports[port];
+  u16 used = (p->head - p->tail + HOST_BUF) % HOST_BUF;
+  return used < host_ps2_capacity ? host_ps2_capacity - used : 0;
+}
+
+// a pipe is the wire itself, there is no queue to hold back or clear
+void hal_ps2_expect(u8 port) {
+  (void)port;
+}
+
+void hal_ps2_clear(u8 port) {
+  (void)port;
+}
+
+bool hal_ps2_busy(u8 port) {
+  return host_now < host_ports[port].busy_until;
+}
+
+void hal_ps2_task(u8 port) {
+  (void)port;
+}
+
+void hal_ps2in_reset(u8 port) {
+  (void)port;
+}
+
+void hal_ps2in_set(u8 port, u8 command, u8 byte) {
+  (void)port;
+  (void)command;
+  (void)byte;
+}
+
+void hal_alarm_at(u64 us) {
+  host_alarm = us;
+}
+
+// single threaded, nothing to keep out
+u32 hal_lock() {
+  return 0;
+}
+
+void hal_unlock(u32 state) {
+  (void)state;
+}
+
+u64 hal_time_us() {
+  return host_now;
+}
+
+bool hal_hid_receive_report(u8 dev_addr, u8 instance) {
+  (void)dev_addr;
+  (void)instance;
+  return true;
+}
+
+void hal_hid_set_leds(u8 dev_addr, u8 instance, u8* leds) {
+  (void)dev_addr;
+  (void)instance;
+  host_leds = *leds;
+}
+
+void hal_led(bool on) {
+  (void)on;
+}
+
+void hal_kb_key(u8 key, bool is_key_pressed, u8 modifiers) {
+  kb_send_key(key, is_key_pressed, modifiers);
+}
+
+void hal_ms_movement(u8 buttons, s32 x, s32 y, s8 z) {
+  ms_send_movement(MS_USB, buttons, x, y, z);
+}
+
+void hal_kb_leds(u8 leds) {
+  tuh_kb_set_leds(leds);
+}
+
+// no UART to keep free here, format right away
+void hal_trace(u8 event, const u8* args, u8 len) {
+  if(!host_trace) return;
+  char line[1024];
+  trace_format(line, sizeof(line), event, args, len);
+  printf("%s\n", line);
+}
+
+void host_advance_us(u64 us) {
+  u64 target = host_now + us;
+
+  while(host_alarm && host_alarm <= target) {
+    host_now = host_alarm;
+    host_alarm = 0;
+    sched_run();
+  }
+
+  host_now = target;
+}
+
+void host_ps2_receive(u8 port, u8 byte) {
+  host_port* p = &host_ports[port];
+
+  if(byte == 0xfe) {
+    hal_ps2_send(port, p->last_tx);
+    return;
+  }
+
+  p->tail = p->head;
+  (*p->rx)(byte, p->last_rx);
+  p->last_rx = byte;
+}
+
+u16 host_ps2_read(u8 port, u8* buf, u16 len) {
+  host_port* p = &host_ports[port];
+  u16 i = 0;
+  while(i < len && p->tail != p->head) {
+    p->last_tx = p->buf[p->tail];
+    buf[i++] = p->last_tx;
+    p->tail = (p->tail + 1) % HOST_BUF;
+  }
+  return i;
+}
@@ -0,0 +1,133 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 No0ne (https://github.com/No0ne)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "check.h"
+
+// hidcheck - HID report descriptors compiled into extraction plans by usbin.c
+//
+// Mice and keyboards of several layouts are mounted and their reports checked
+// by the PS/2 bytes they cause. Reports cut short read 0 past their end.
+
+static const u8 desc_ms_8bit[] = {
+  0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x09, 0x01, 0xa1, 0x00, 0x05, 0x09, 0x19, 0x01, 0x29, 0x03,
+  0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x01,
+  0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x03,
+  0x81, 0x06, 0xc0, 0xc0
+};
+
+// 5 buttons, 16-bit X/Y and a wheel behind report id 2
+static const u8 desc_ms_16bit[] = {
+  0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x85, 0x02, 0x09, 0x01, 0xa1, 0x00, 0x05, 0x09, 0x19, 0x01,
+  0x29, 0x05, 0x15, 0x00, 0x25, 0x01, 0x95, 0x05, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x03,
+  0x81, 0x01, 0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x16, 0x01, 0x80, 0x26, 0xff, 0x7f, 0x75, 0x10,
+  0x95, 0x02, 0x81, 0x06, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x01, 0x81, 0x06,
+  0xc0, 0xc0
+};
+
+// 12-bit X/Y packed into 3 bytes
+static const u8 desc_ms_12bit[] = {
+  0x05, 0x01, 0x09, 0x02, 0xa1, 0x01, 0x09, 0x01, 0xa1, 0x00, 0x05, 0x09, 0x19, 0x01, 0x29, 0x03,
+  0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x01,
+  0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x16, 0x01, 0xf8, 0x26, 0xff, 0x07, 0x75, 0x0c, 0x95, 0x02,
+  0x81, 0x06, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7f, 0x75, 0x08, 0x95, 0x01, 0x81, 0x06, 0xc0, 0xc0
+};
+
+// Boot-like keyboard with its LED output bits between the reserved byte and the key array
+static const u8 desc_kb_leds[] = {
+  0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7, 0x15, 0x00, 0x25, 0x01,
+  0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01, 0x75, 0x08, 0x81, 0x01, 0x05, 0x08, 0x19, 0x01,
+  0x29, 0x05, 0x95, 0x05, 0x75, 0x01, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06,
+  0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00, 0xc0
+};
+
+// Modifiers and a 120-bit key bitmap
+static const u8 desc_kb_nkro[] = {
+  0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7, 0x15, 0x00, 0x25, 0x01,
+  0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x19, 0x00, 0x29, 0x77, 0x95, 0x78, 0x81, 0x02, 0xc0
+};
+
+void check_mouse(const char* name, const u8* desc, u16 desc_len, const u8* report, u16 len, s32 x, s32 y, u8 buttons) {
+  usbin_mount(1, 0, HID_ITF_PROTOCOL_MOUSE, HID_PROTOCOL_REPORT, 0, 0, desc, desc_len);
+  usbin_report(1, 0, report, len);
+  check_run_us(100000);
+  check_ms ms = check_ms_read();
+  CHECK(ms.x == x && ms.y == -y, "%s: moved %d/%d instead of %d/%d", name, ms.x, -ms.y, x, y);
+  CHECK(ms.buttons == buttons, "%s: buttons %x instead of %x", name, ms.buttons, buttons);
+
+  usbin_umount(1, 0);
+  check_run_us(100000);
+  check_ms_read();
+}
+
+void check_keyboard(const char* name, const u8* desc, u16 desc_len, const u8* report, u16 len, const char* bytes) {
+  u8 none[16] = { 0 };
+  usbin_mount(2, 0, HID_ITF_PROTOCOL_KEYBOARD, HID_PROTOCOL_REPORT, 0, 0, desc, desc_len);
+  usbin_report(2, 0, report, len);
+  usbin_report(2, 0, none, len);
+  check_run_us(20000);
+  const char* got = check_bytes(PS2_KB);
+  CHECK(!strcmp(got, bytes), "%s: sent '%s' instead of '%s'", name, got, bytes);
+  usbin_umount(2, 0);
+}
+
+int main() {
+  host_trace = false;
+  kb_init(0, 0);
+  ms_init(0, 0);
+  check_run_us(1000000);
+  check_bytes(PS2_KB);
+  host_ps2_receive(PS2_MS, 0xf4);
+  check_run_us(200000);
+  check_bytes(PS2_MS);
+
+  // buttons 1 and 3, x 5, y -3
+  u8 ms_8bit[] = { 0x05, 0x05, 0xfd, 0x00 };
+  check_mouse("8-bit mouse", desc_ms_8bit, sizeof(desc_ms_8bit), ms_8bit, sizeof(ms_8bit), 5, -3, 5);
+
+  // button 2, x 300, y -200, spread over several packets
+  u8 ms_16bit[] = { 0x02, 0x02, 0x2c, 0x01, 0x38, 0xff, 0x00 };
+  check_mouse("16-bit mouse", desc_ms_16bit, sizeof(desc_ms_16bit), ms_16bit, sizeof(ms_16bit), 300, -200, 2);
+
+  // x -2 is 0xffe, y 291 is 0x123
+  u8 ms_12bit[] = { 0x01, 0xfe, 0x3f, 0x12, 0x00 };
+  check_mouse("12-bit mouse", desc_ms_12bit, sizeof(desc_ms_12bit), ms_12bit, sizeof(ms_12bit), -2, 291, 1);
+
+  // cut short after X, Y and the wheel read 0
+  check_mouse("16-bit mouse cut short", desc_ms_16bit, sizeof(desc_ms_16bit), ms_16bit, 4, 300, 0, 2);
+
+  // left shift and A
+  u8 kb_leds[] = { 0x02, 0x00, HID_KEY_A, 0, 0, 0, 0, 0 };
+  check_keyboard("keyboard with LEDs", desc_kb_leds, sizeof(desc_kb_leds), kb_leds, sizeof(kb_leds), "12 1c f0 12 f0 1c");
+
+  // left shift and A, which is usage 4 and bit 4 of the bitmap
+  u8 kb_nkro[16] = { 0x02, 0x10 };
+  check_keyboard("nkro keyboard", desc_kb_nkro, sizeof(desc_kb_nkro), kb_nkro, sizeof(kb_nkro), "12 1c f0 12 f0 1c");
+
+  // a report cut short in the key array has the keys up to its end,
+  // one without any of it is not taken for a keyboard report
+  check_keyboard("keyboard cut short", desc_kb_leds, sizeof(desc_kb_leds), kb_leds, 3, "12 1c f0 12 f0 1c");
+  check_keyboard("keyboard without keys", desc_kb_leds, sizeof(desc_kb_leds), kb_leds, 2, "");
+
+  return check_done("hidcheck");
+}
@@ -0,0 +1,124 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 No0ne (https://github.com/No0ne)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include <time.h>
+#include <unistd.h>
+#include "hal_host.h"
+
+// kbbench - feeds keyboard reports through usbin.c and ps2kb.c and prints reports per second
+//
+// usage: kbbench [reports]
+//
+// The same typing pattern is sent by a 6KRO and by an NKRO keyboard. The PS/2 bytes
+// are drained after every report, their count and checksum make the output of two builds
+// easy to compare.
+
+#define BENCH_PATTERN 256
+
+// the results, stdout itself goes to /dev/null to keep the firmware's mount messages out
+FILE* bench_out;
+
+static const u8 desc_6kro[] = {
+  0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7, 0x15, 0x00, 0x25, 0x01,
+  0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01, 0x75, 0x08, 0x81, 0x01, 0x95, 0x06, 0x75, 0x08,
+  0x15, 0x00, 0x25, 0x65, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00, 0xc0
+};
+
+static const u8 desc_nkro[] = {
+  0x05, 0x01, 0x09, 0x06, 0xa1, 0x01, 0x05, 0x07, 0x19, 0xe0, 0x29, 0xe7, 0x15, 0x00, 0x25, 0x01,
+  0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x19, 0x00, 0x29, 0x77, 0x95, 0x78, 0x81, 0x02, 0xc0
+};
+
+u8 reports_6kro[BENCH_PATTERN][8];
+u8 reports_nkro[BENCH_PATTERN][16];
+
+// six keys held at a time, one of them changes per report, shift every few reports
+void bench_pattern() {
+  u8 held[6] = {0};
+  u8 next = HID_KEY_A;
+
+  for(u16 r = 0; r < BENCH_PATTERN; r++) {
+    if(r % 32 == 31) {
+      memset(held, 0, sizeof(held));
+    } else {
+      held[r % 6] = next;
+      next = next == HID_KEY_ENTER - 1 ? HID_KEY_A : next + 1;
+    }
+
+    u8 modifiers = (r / 7) & 1 ? KEYBOARD_MODIFIER_LEFTSHIFT : 0;
+    reports_6kro[r][0] = modifiers;
+    reports_nkro[r][0] = modifiers;
+
+    for(u8 i = 0; i < 6; i++) {
+      reports_6kro[r][2 + i] = held[i];
+      if(held[i]) reports_nkro[r][1 + (held[i] >> 3)] |= 1 << (held[i] & 7);
+    }
+  }
+}
+
+void bench_run(const char* name, u8 dev_addr, const u8* desc, u16 desc_len, u8* reports, u16 len, u32 count) {
+  u8 buf[256];
+  u32 bytes = 0;
+  u32 sum = 0;
+
+  usbin_mount(dev_addr, 0, HID_ITF_PROTOCOL_KEYBOARD, HID_PROTOCOL_REPORT, 0, 0, desc, desc_len);
+  host_ps2_read(PS2_KB, buf, sizeof(buf));
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for(u32 i = 0; i < count; i++) {
+    usbin_report(dev_addr, 0, &reports[(i % BENCH_PATTERN) * len], len);
+
+    u16 n;
+    while((n = host_ps2_read(PS2_KB, buf, sizeof(buf)))) {
+      for(u16 j = 0; j < n; j++) sum = sum * 31 + buf[j];
+      bytes += n;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  usbin_umount(dev_addr, 0);
+
+  double s = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  fprintf(bench_out, "%-5s %10.0f reports/s  %8.1f ns/report  %u bytes  sum %08x\n", name, count / s, s * 1e9 / count, bytes, sum);
+}
+
+int main(int argc, char** argv) {
+  u32 count = argc > 1 ? strtoul(argv[1], NULL, 0) : 1000000;
+
+  bench_out = fdopen(dup(STDOUT_FILENO), "w");
+  if(!bench_out || !freopen("/dev/null", "w", stdout)) return 1;
+  setvbuf(bench_out, NULL, _IOLBF, 0);
+
+  // trace records are not formatted at all, like the firmware leaves that to tracedec
+  host_trace = false;
+  kb_init(0, 0);
+  bench_pattern();
+
+  bench_run("6kro", 1, desc_6kro, sizeof(desc_6kro), &reports_6kro[0][0], sizeof(reports_6kro[0]), count);
+  bench_run("nkro", 2, desc_nkro, sizeof(desc_nkro), &reports_nkro[0][0], sizeof(reports_nkro[0]), count);
+
+  return host_dropped ? 1 : 0;
+}
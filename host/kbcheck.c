@@ -0,0 +1,80 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 No0ne (https://github.com/No0ne)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "check.h"
+
+// kbcheck - keys of several keyboards merged by usbin.c
+//
+// Two boot protocol keyboards hold keys together. The host sees the first make
+// and the last break of a key, and one keyboard's shift applies to the other's keys.
+
+void report(u8 dev_addr, u8 modifiers, u8 key) {
+  u8 r[8] = { modifiers, 0, key };
+  usbin_report(dev_addr, 0, r, sizeof(r));
+  check_run_us(20000);
+}
+
+void expect(const char* what, const char* bytes) {
+  const char* got = check_bytes(PS2_KB);
+  CHECK(!strcmp(got, bytes), "%s: sent '%s' instead of '%s'", what, got, bytes);
+}
+
+int main() {
+  host_trace = false;
+  kb_init(0, 0);
+  check_run_us(1000000);
+  check_bytes(PS2_KB);
+
+  usbin_mount(1, 0, HID_ITF_PROTOCOL_KEYBOARD, HID_PROTOCOL_BOOT, 0, 0, NULL, 0);
+  usbin_mount(2, 0, HID_ITF_PROTOCOL_KEYBOARD, HID_PROTOCOL_BOOT, 0, 0, NULL, 0);
+
+  report(1, 0, HID_KEY_A);
+  expect("A on the first", "1c");
+  report(2, 0, HID_KEY_A);
+  expect("A on both", "");
+  report(1, 0, 0);
+  expect("A released on the first", "");
+  report(2, 0, 0);
+  expect("A released on both", "f0 1c");
+
+  report(1, KEYBOARD_MODIFIER_LEFTSHIFT, 0);
+  expect("shift on the first", "12");
+  report(2, 0, HID_KEY_B);
+  expect("B on the second", "32");
+  report(2, 0, 0);
+  report(1, 0, 0);
+  expect("B and shift released", "f0 32 f0 12");
+
+  report(1, KEYBOARD_MODIFIER_LEFTCTRL, HID_KEY_A);
+  report(2, 0, HID_KEY_B);
+  expect("ctrl A and B", "14 1c 32");
+  usbin_umount(1, 0);
+  check_run_us(20000);
+  expect("first unplugged", "f0 14 f0 1c");
+  usbin_umount(2, 0);
+  check_run_us(20000);
+  expect("second unplugged", "f0 32");
+
+  return check_done("kbcheck");
+}
@@ -0,0 +1,172 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 No0ne (https://github.com/No0ne)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "check.h"
+
+// mscheck - USB mouse movement to PS/2 packets in ps2ms.c
+//
+// Movement is added up in 32 bits and follows the host's resolution and scaling.
+// Button changes are sent one per packet, the buttons of several mice are combined.
+
+void cmd(u8 byte, const char* reply) {
+  host_ps2_receive(PS2_MS, byte);
+  check_run_us(20000);
+  const char* got = check_bytes(PS2_MS);
+  CHECK(!strcmp(got, reply), "command %02x: replied '%s' instead of '%s'", byte, got, reply);
+}
+
+// reports of x/y each, one per ms like a 1000 Hz mouse, and the packets they caused
+check_ms move(u16 reports, s32 x, s32 y) {
+  for(u16 i = 0; i < reports; i++) {
+    hal_ms_movement(0, x, y, 0);
+    check_run_us(1000);
+  }
+  check_run_us(500000);
+  return check_ms_read();
+}
+
+int main() {
+  host_trace = false;
+  ms_init(0, 0);
+  check_run_us(200000);
+  check_bytes(PS2_MS);
+  cmd(0xf4, "fa");
+
+  // far more than one packet holds is spread over the next ones
+  check_ms ms = move(1, 3000, -2000);
+  CHECK(ms.x == 3000 && ms.y == 2000 && !ms.overflow, "large report: %d/%d overflow %x", ms.x, ms.y, ms.overflow);
+  CHECK(ms.packets >= 12, "large report: only %u packets", ms.packets);
+
+  // beyond 16 full packets per axis the rest is dropped and flagged
+  ms = move(10, 3000, 0);
+  CHECK(ms.x >= 4080 && ms.x < 30000 && ms.overflow == 0x40, "flick: x %d overflow %x", ms.x, ms.overflow);
+
+  // 1 count/mm is a quarter of the default, fractions are kept for the next reports
+  cmd(0xe8, "fa");
+  cmd(0x00, "fa");
+  ms = move(3, 1, 0);
+  CHECK(ms.x == 0, "3 counts at 1 count/mm: x %d", ms.x);
+  ms = move(1, 1, 0);
+  CHECK(ms.x == 1, "4 counts at 1 count/mm: x %d", ms.x);
+
+  // 8 counts/mm doubles the counts
+  cmd(0xe8, "fa");
+  cmd(0x03, "fa");
+  ms = move(1, 5, 7);
+  CHECK(ms.x == 10 && ms.y == -14, "8 counts/mm: %d/%d", ms.x, ms.y);
+
+  // 2:1 scaling maps 1..5 to 1 1 3 6 9 and doubles larger counts
+  cmd(0xe8, "fa");
+  cmd(0x02, "fa");
+  cmd(0xe7, "fa");
+  ms = move(1, 5, 0);
+  CHECK(ms.x == 9, "5 counts scaled: x %d", ms.x);
+  ms = move(1, 20, 0);
+  CHECK(ms.x == 40, "20 counts scaled: x %d", ms.x);
+
+  // stream mode, enabled, 2:1, 4 counts/mm, 100 samples/s
+  cmd(0xe9, "fa 30 02 64");
+  cmd(0xe6, "fa");
+
+  // remote mode only sends a packet on Read Data, never scaled
+  cmd(0xf0, "fa");
+  hal_ms_movement(1, 7, 3, 0);
+  check_run_us(100000);
+  CHECK(!host_ps2_read(PS2_MS, (u8[4]){ 0 }, 4), "remote mode sent a packet on its own");
+  cmd(0xeb, "fa 29 07 fd");
+  cmd(0xe9, "fa 64 02 64");
+
+  // defaults
+  cmd(0xf6, "fa");
+  cmd(0xe9, "fa 00 02 64");
+
+  // Every button change gets a packet of its own, even when a click is shorter than
+  // the host's sample interval. 50 clicks, each held 2 ms, one every 10 ms.
+  u8 rates[] = { 40, 100 };
+  for(u8 r = 0; r < sizeof(rates); r++) {
+    cmd(0xf3, "fa");
+    cmd(rates[r], "fa");
+    cmd(0xf4, "fa");
+    for(u8 c = 0; c < 50; c++) {
+      for(u8 i = 0; i < 10; i++) {
+        hal_ms_movement(i < 2, 1, 0, 0);
+        check_run_us(1000);
+      }
+    }
+    check_run_us(500000);
+    ms = check_ms_read();
+    CHECK(ms.changes == 100 && ms.x == 500, "clicks at %u Hz: %u changes x %d", rates[r], ms.changes, ms.x);
+    cmd(0xf5, "fa");
+  }
+
+  // a click does not wait for the next sample at 10 Hz
+  cmd(0xf3, "fa");
+  cmd(10, "fa");
+  cmd(0xf4, "fa");
+  check_run_us(300000);
+  hal_ms_movement(1, 0, 0, 0);
+  check_run_us(5000);
+  ms = check_ms_read();
+  CHECK(ms.changes == 1, "click at 10 Hz not sent within 5 ms");
+  hal_ms_movement(0, 0, 0, 0);
+  check_run_us(5000);
+  ms = check_ms_read();
+  CHECK(ms.changes == 1, "release at 10 Hz not sent within 5 ms");
+
+  // Two USB mice and the passthrough mouse share the port. A button is held
+  // while any of them holds it, unplugging a mouse releases its buttons.
+  cmd(0xf3, "fa");
+  cmd(100, "fa");
+  usbin_mount(1, 0, HID_ITF_PROTOCOL_MOUSE, HID_PROTOCOL_BOOT, 0, 0, NULL, 0);
+  usbin_mount(2, 0, HID_ITF_PROTOCOL_MOUSE, HID_PROTOCOL_BOOT, 0, 0, NULL, 0);
+  check_run_us(200000);
+  check_ms_read();
+  struct { u8 source; u8 buttons; s8 x; u8 seen; } steps[] = {
+    { 1, 1, 0, 1 }, // left on the first
+    { 2, 0, 5, 1 }, // the second moves, left stays
+    { 2, 2, 5, 3 }, // right on the second
+    { 1, 0, 3, 2 }, // the first lets go of left
+    { 0, 4, 1, 6 }, // middle on the passthrough mouse
+    { 2, 2, 1, 6 },
+    { 0xff, 0, 0, 4 }, // the second is unplugged
+    { 0, 0, 0, 0 }, // the passthrough mouse lets go
+  };
+  for(u8 i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+    if(steps[i].source == 0xff) {
+      usbin_umount(2, 0);
+    } else if(steps[i].source) {
+      u8 r[3] = { steps[i].buttons, (u8)steps[i].x, 0 };
+      usbin_report(steps[i].source, 0, r, sizeof(r));
+    } else {
+      ms_send_movement(MS_PS2IN, steps[i].buttons, steps[i].x, 0, 0);
+    }
+    check_run_us(30000);
+    ms = check_ms_read();
+    CHECK(ms.packets && ms.buttons == steps[i].seen && ms.x == steps[i].x,
+      "mice step %u: buttons %x x %d instead of %x %d", i, ms.buttons, ms.x, steps[i].seen, steps[i].x);
+  }
+  usbin_umount(1, 0);
+
+  return check_done("mscheck");
+}
@@ -0,0 +1,180 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 No0ne (https://github.com/No0ne)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#ifndef _PIOSIM_HARDWARE_PIO_H
+#define _PIOSIM_HARDWARE_PIO_H
+
+// The subset of the pico-sdk PIO API used by ps2out/ps2in, backed by piosim.c.
+// The pioasm generated headers include this file, so the program init
+// functions run unchanged against the simulator.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef unsigned int uint;
+
+typedef struct {
+  float clkdiv;
+  uint wrap_target;
+  uint wrap;
+  uint sideset_bits;
+  bool sideset_opt;
+  bool sideset_pindirs;
+  uint sideset_base;
+  uint set_base;
+  uint set_count;
+  uint out_base;
+  uint out_count;
+  uint in_base;
+  uint jmp_pin;
+  bool out_right;
+  bool autopull;
+  uint pull_thresh;
+  bool in_right;
+  bool autopush;
+  uint push_thresh;
+} pio_sm_config;
+
+typedef struct {
+  const uint16_t* prog;
+  uint32_t x;
+  uint32_t y;
+  uint32_t isr;
+  uint32_t osr;
+  uint8_t isr_count;
+  uint8_t osr_count;
+  uint32_t txf[4];
+  uint8_t tx_level;
+  uint32_t rxf[4];
+  uint8_t rx_level;
+  uint8_t pc;
+  uint8_t delay;
+  bool irq_wait;
+  bool enabled;
+  bool claimed;
+  uint64_t next;
+  uint32_t div;
+  pio_sm_config c;
+} pio_sm_hw_t;
+
+typedef struct {
+  uint16_t instr_mem[32];
+  uint8_t used;
+  uint8_t irq;
+  uint32_t inte0;
+  uint32_t txf[4]; // DMA target addresses only, the data goes to the SM selected by the DREQ
+  pio_sm_hw_t sm[4];
+} pio_hw_t;
+
+typedef pio_hw_t* PIO;
+
+struct pio_program {
+  const uint16_t* instructions;
+  uint8_t length;
+  int8_t origin;
+};
+
+extern pio_hw_t* pio0;
+extern pio_hw_t* pio1;
+
+// Bit positions in the INTR register like in the SDK
+enum pio_interrupt_source {
+  pis_sm0_rx_fifo_not_empty = 0,
+  pis_sm1_rx_fifo_not_empty,
+  pis_sm2_rx_fifo_not_empty,
+  pis_sm3_rx_fifo_not_empty,
+  pis_sm0_tx_fifo_not_full,
+  pis_sm1_tx_fifo_not_full,
+  pis_sm2_tx_fifo_not_full,
+  pis_sm3_tx_fifo_not_full,
+  pis_interrupt0,
+  pis_interrupt1,
+  pis_interrupt2,
+  pis_interrupt3
+};
+
+pio_sm_config pio_get_default_sm_config();
+void sm_config_set_wrap(pio_sm_config* c, uint wrap_target, uint wrap);
+void sm_config_set_sideset(pio_sm_config* c, uint bit_count, bool optional, bool pindirs);
+void sm_config_set_sideset_pins(pio_sm_config* c, uint sideset_base);
+void sm_config_set_clkdiv(pio_sm_config* c, float div);
+void sm_config_set_jmp_pin(pio_sm_config* c, uint pin);
+void sm_config_set_set_pins(pio_sm_config* c, uint set_base, uint set_count);
+void sm_config_set_out_pins(pio_sm_config* c, uint out_base, uint out_count);
+void sm_config_set_in_pins(pio_sm_config* c, uint in_base);
+void sm_config_set_out_shift(pio_sm_config* c, bool shift_right, bool autopull, uint pull_threshold);
+void sm_config_set_in_shift(pio_sm_config* c, bool shift_right, bool autopush, uint push_threshold);
+
+uint pio_add_program(PIO pio, const struct pio_program* program);
+int pio_claim_unused_sm(PIO pio, bool required);
+void pio_gpio_init(PIO pio, uint pin);
+void pio_sm_init(PIO pio, uint sm, uint initial_pc, const pio_sm_config* config);
+void pio_sm_set_enabled(PIO pio, uint sm, bool enabled);
+
+void pio_sm_put(PIO pio, uint sm, uint32_t data);
+uint32_t pio_sm_get(PIO pio, uint sm);
+bool pio_sm_is_rx_fifo_empty(PIO pio, uint sm);
+bool pio_sm_is_tx_fifo_full(PIO pio, uint sm);
+uint pio_sm_get_tx_fifo_level(PIO pio, uint sm);
+bool pio_interrupt_get(PIO pio, uint irq);
+void pio_interrupt_clear(PIO pio, uint irq);
+void pio_set_irq0_source_enabled(PIO pio, enum pio_interrupt_source source, bool enabled);
+uint pio_get_index(PIO pio);
+uint pio_get_dreq(PIO pio, uint sm, bool is_tx);
+
+bool pio_sm_is_tx_fifo_empty(PIO pio, uint sm);
+void pio_sm_clear_fifos(PIO pio, uint sm);
+void pio_sm_drain_tx_fifo(PIO pio, uint sm);
+void pio_sm_restart(PIO pio, uint sm);
+void pio_sm_exec(PIO pio, uint sm, uint instr);
+uint8_t pio_sm_get_pc(PIO pio, uint sm);
+
+enum pio_src_dest {
+  pio_pins = 0,
+  pio_x = 1,
+  pio_y = 2,
+  pio_null = 3,
+  pio_pindirs = 4,
+  pio_pc = 5,
+  pio_isr = 6,
+  pio_osr = 7
+};
+
+static inline uint pio_encode_jmp(uint addr) {
+  return addr;
+}
+
+static inline uint pio_encode_out(enum pio_src_dest dest, uint count) {
+  return 3u << 13 | dest << 5 | (count & 31);
+}
+
+static inline uint pio_encode_push(bool if_full, bool block) {
+  return 4u << 13 | if_full << 6 | block << 5;
+}
+
+static inline uint pio_encode_mov(enum pio_src_dest dest, enum pio_src_dest src) {
+  return 5u << 13 | dest << 5 | src;
+}
+
+#endif
@@ -0,0 +1,680 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 No0ne (https://github.com/No0ne)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include <stdarg.h>
+#include "piosim.h"
+#include "ps2in.pio.h"
+#include "hardware/timer.h"
+
+// piosim - runs the ps2out/ps2in PIO programs against a scripted PS/2 bus
+//
+// usage: piosim [-v] script.sim
+//
+// Script lines, times in µs:
+//   program ps2out|ps2in      firmware side under test (default ps2out)
+//   sm <n>                    state machine index of the first port
+//   ports <n>                 number of PS/2 ports, port n uses GPIO 2n/2n+1 and the next state machine
+//   loop <us>                 main loop period of the firmware
+//   gap <us>                  idle time between two firmware bytes (ps2out)
+//   hold <us>                 host holds clock low after every byte like an 8042
+//   devclk <us>               device clock half period (ps2in)
+//   trace on|off              same as -v
+//   histogram <stat>          also print the distribution of bit, byte, gap, rts, ack, inhibit, lat or reply
+//   reply <byte> <bytes..>    answer a received byte (firmware for ps2out, device for ps2in)
+//   argument <byte>           the firmware waits for an argument after this host byte (ps2out)
+//   at <us> [every <us> <n>] [port <n>] send <bytes..>   firmware transmits one packet, or queues it
+//                             until there is room
+//   at <us> [every <us> <n>] [port <n>] reply <bytes..>  firmware answers late, like after a reset (ps2out)
+//   at <us> [every <us> <n>] [port <n>] host <byte>      host sends a command (ps2out)
+//   at <us> [every <us> <n>] [port <n>] device <bytes..> device transmits (ps2in)
+//   at <us> [every <us> <n>] [port <n>] inhibit <us>     host pulls clock low
+//   run <us>                  simulate up to this time
+//   expect <stat> <op> <value>  fail unless e.g. "gap_max < 1000"
+//
+// Stats without a prefix are summed or merged over all ports, "1.lat_max" is the
+// value of port 1 only. fw_input, fw_queue, fw_bus and fw_ack are ps2out's own
+// latency histograms, with _max and _n, fw_retries and fw_retried its retry counters
+// for bytes and packets. queued counts bytes sent again after the host
+// cut a packet short, restarts how often that happened. lat is the time a packet waits for the wire,
+// reply the same for reply bytes, which go out ahead of the packets.
+
+enum { A_SEND, A_REPLY, A_HOST, A_DEVICE, A_INHIBIT };
+
+typedef struct {
+  u64 t;
+  u32 seq;
+  u8 cmd;
+  u8 port;
+  u8 len;
+  u8 bytes[16];
+  u32 arg;
+} sim_action;
+
+typedef struct {
+  char stat[16];
+  char op[3];
+  char value[16];
+} sim_expect;
+
+sim_stat sim_stats[SIM_PORTS][ST_COUNT];
+const char* sim_stat_names[ST_COUNT] = { "bit", "byte", "gap", "rts", "ack", "inhibit", "lat", "reply" };
+u32 sim_bytes[SIM_PORTS];
+u32 sim_errors = 0;
+u32 sim_pending[SIM_PORTS];
+u32 sim_queued[SIM_PORTS];
+u8 sim_ports = 1;
+bool sim_trace = false;
+
+// Packets queued by the firmware and not yet on the wire, for the lat stat and to check
+// that the host gets every byte in order. Sends that do not fit into ps2out wait in the
+// backlog, like key changes wait for kb_ready() in the firmware.
+typedef struct {
+  u64 t;
+  u8 left;
+  bool started;
+  bool timed;
+  u8 len;
+  u8 bytes[16];
+} sim_packet;
+
+sim_packet sim_packets[SIM_PORTS][256];
+u8 sim_packet_head[SIM_PORTS];
+u8 sim_packet_tail[SIM_PORTS];
+#define SIM_BACKLOG 4096
+sim_packet sim_backlog[SIM_PORTS][SIM_BACKLOG];
+u16 sim_backlog_head[SIM_PORTS];
+u16 sim_backlog_tail[SIM_PORTS];
+u32 sim_restarts[SIM_PORTS];
+u8 sim_reply[256][16];
+bool sim_argument[256];
+
+// Reply bytes queued by the firmware and not yet on the wire, for the reply stat
+u64 sim_replies[SIM_PORTS][256];
+u8 sim_reply_bytes[SIM_PORTS][256];
+u8 sim_reply_head[SIM_PORTS];
+u8 sim_reply_tail[SIM_PORTS];
+bool sim_replying[SIM_PORTS];
+
+// The host asked for the last byte again, it comes before anything else
+u8 sim_last[SIM_PORTS];
+bool sim_resend_pending[SIM_PORTS];
+bool sim_resending[SIM_PORTS];
+
+sim_action* actions = NULL;
+u32 action_count = 0;
+sim_expect expects[32];
+u8 expect_count = 0;
+
+bool fw_ps2out = true;
+u8 fw_sm = 0;
+u32 fw_loop_us = 5;
+u32 fw_gap_us = PS2OUT_GAP_US;
+u64 sim_end = 0;
+ps2out fw_out[SIM_PORTS];
+uint fw_in_sm[SIM_PORTS];
+
+void sim_stat_add(u8 port, u8 stat, double us) {
+  sim_stat* s = &sim_stats[port][stat];
+  if(!s->n || us < s->min) s->min = us;
+  if(!s->n || us > s->max) s->max = us;
+  s->sum += us;
+  s->n++;
+
+  u8 bucket = 0;
+  while(bucket < SIM_HIST - 1 && us >= 8u << bucket) bucket++;
+  s->hist[bucket]++;
+}
+
+void sim_log(const char* fmt, ...) {
+  if(!sim_trace) return;
+  va_list args;
+  va_start(args, fmt);
+  printf("%12.2f us  ", SIM_TO_US(sim_now));
+  vprintf(fmt, args);
+  printf("\n");
+  va_end(args);
+}
+
+void sim_resend(u8 port) {
+  sim_resend_pending[port] = true;
+  sim_queued[port]++;
+  sim_pending[port]++;
+}
+
+void sim_packet_start(u8 port) {
+  sim_packet* p = &sim_packets[port][sim_packet_tail[port]];
+  bool packet = sim_packet_head[port] != sim_packet_tail[port];
+
+  sim_resending[port] = sim_resend_pending[port];
+  sim_resend_pending[port] = false;
+  if(sim_resending[port]) return;
+
+  // replies only go out between packets
+  sim_replying[port] = sim_reply_head[port] != sim_reply_tail[port] && !(packet && p->started);
+  if(sim_replying[port]) {
+    sim_stat_add(port, ST_REPLY, SIM_TO_US(sim_now - sim_replies[port][sim_reply_tail[port]]));
+    return;
+  }
+
+  if(!packet || p->started) return;
+  if(!p->timed) sim_stat_add(port, ST_LAT, SIM_TO_US(sim_now - p->t));
+  p->started = true;
+  p->timed = true;
+}
+
+void sim_packet_byte(u8 port, u8 byte) {
+  u8 want;
+  if(sim_resending[port]) {
+    want = sim_last[port];
+    sim_resending[port] = false;
+  } else if(sim_replying[port]) {
+    want = sim_reply_bytes[port][sim_reply_tail[port]++];
+    sim_replying[port] = false;
+  } else if(sim_packet_head[port] != sim_packet_tail[port]) {
+    sim_packet* p = &sim_packets[port][sim_packet_tail[port]];
+    want = p->bytes[p->len - p->left];
+    if(!--p->left) sim_packet_tail[port]++;
+  } else {
+    return;
+  }
+
+  if(byte != want) {
+    sim_log("%s: got %02x instead of %02x", peer_name(port), byte, want);
+    sim_errors++;
+  }
+  sim_last[port] = byte;
+}
+
+bool fw_queue(u8 port, sim_packet* p) {
+  // the scripted send is the input
+  if(!ps2out_send(&fw_out[port], p->bytes, p->len, time_us_32() - (u32)SIM_TO_US(sim_now - p->t))) return false;
+  sim_queued[port] += p->len;
+  sim_pending[port] += p->len;
+  sim_packets[port][sim_packet_head[port]++] = *p;
+  return true;
+}
+
+void fw_send(u8 port, const u8* bytes, u8 len) {
+  if(fw_ps2out) {
+    sim_packet p = { sim_now, len, false, false, len, { 0 } };
+    memcpy(p.bytes, bytes, len);
+    if(sim_backlog_head[port] != sim_backlog_tail[port] || !fw_queue(port, &p)) {
+      if((u16)(sim_backlog_head[port] - sim_backlog_tail[port]) == SIM_BACKLOG) {
+        sim_log("firmware: port %u backlog full, %u bytes dropped", port, len);
+        sim_errors++;
+        return;
+      }
+      sim_backlog[port][sim_backlog_head[port]++ % SIM_BACKLOG] = p;
+    }
+  } else {
+    for(u8 i = 0; i < len; i++) pio_sm_put(pio0, fw_in_sm[port], ps2_frame(bytes[i]));
+  }
+}
+
+void fw_reply(u8 port, const u8* bytes, u8 len) {
+  for(u8 i = 0; i < len; i++) {
+    if(!ps2out_reply(&fw_out[port], bytes[i])) {
+      sim_log("firmware: port %u reply queue full, %02x dropped", port, bytes[i]);
+      sim_errors++;
+      continue;
+    }
+    sim_queued[port]++;
+    sim_pending[port]++;
+    sim_reply_bytes[port][sim_reply_head[port]] = bytes[i];
+    sim_replies[port][sim_reply_head[port]++] = sim_now;
+  }
+}
+
+void fw_receive(u8 port, u8 byte) {
+  sim_log("firmware%s < %02x", port ? "1" : "", byte);
+
+  // ps2out drops the replies to the previous command and sends a packet the host cut short again
+  u8 replies = sim_reply_head[port] - sim_reply_tail[port];
+  sim_pending[port] = sim_pending[port] > replies ? sim_pending[port] - replies : 0;
+  sim_reply_tail[port] = sim_reply_head[port];
+  sim_replying[port] = false;
+  sim_packet* p = &sim_packets[port][sim_packet_tail[port]];
+  if(sim_packet_head[port] != sim_packet_tail[port]) {
+    if(p->left < p->len) {
+      sim_queued[port] += p->len - p->left;
+      sim_pending[port] += p->len - p->left;
+      p->left = p->len;
+      sim_restarts[port]++;
+    }
+    p->started = false;
+  }
+
+  if(sim_reply[byte][0]) fw_reply(port, &sim_reply[byte][1], sim_reply[byte][0]);
+  if(sim_argument[byte]) ps2out_expect(&fw_out[port]);
+}
+
+void fw_receive0(u8 byte, u8 prev_byte) {
+  (void)prev_byte;
+  fw_receive(0, byte);
+}
+
+void fw_receive1(u8 byte, u8 prev_byte) {
+  (void)prev_byte;
+  fw_receive(1, byte);
+}
+
+void fw_init() {
+  for(u8 i = 0; i < fw_sm; i++) {
+    pio_claim_unused_sm(fw_ps2out ? pio1 : pio0, true);
+  }
+
+  if(fw_ps2out) {
+    for(u8 port = 0; port < sim_ports; port++) {
+      ps2out_init(&fw_out[port], pio1, SIM_DAT(port), port ? &fw_receive1 : &fw_receive0);
+      fw_out[port].gap_us = fw_gap_us;
+    }
+  } else {
+    uint offset = pio_add_program(pio0, &ps2in_program);
+    for(u8 port = 0; port < sim_ports; port++) {
+      fw_in_sm[port] = pio_claim_unused_sm(pio0, true);
+      ps2in_program_init(pio0, fw_in_sm[port], offset, SIM_DAT(port));
+    }
+  }
+}
+
+void fw_task() {
+  for(u8 port = 0; port < sim_ports; port++) {
+    if(fw_ps2out) {
+      while(sim_backlog_head[port] != sim_backlog_tail[port] && fw_queue(port, &sim_backlog[port][sim_backlog_tail[port] % SIM_BACKLOG])) {
+        sim_backlog_tail[port]++;
+      }
+      ps2out_task(&fw_out[port]);
+      continue;
+    }
+
+    if(!pio_sm_is_rx_fifo_empty(pio0, fw_in_sm[port])) {
+      u32 fifo = pio_sm_get(pio0, fw_in_sm[port]) >> 23;
+      u8 byte = fifo;
+      bool ok = (fifo >> 8 & 1) == (ps2_frame(byte) >> 9 & 1 ? 0 : 1);
+      sim_log("firmware%s < %02x%s", port ? "1" : "", byte, ok ? "" : "  (parity error)");
+      if(!ok) sim_errors++;
+    }
+  }
+}
+
+void run_action(sim_action* a) {
+  switch(a->cmd) {
+    case A_SEND:
+      fw_send(a->port, a->bytes, a->len);
+    break;
+    case A_REPLY:
+      if(fw_ps2out) fw_reply(a->port, a->bytes, a->len);
+    break;
+    case A_HOST:
+      sim_log("%s: request to send %02x", peer_name(a->port), a->bytes[0]);
+      peer_host_send(a->port, a->bytes[0]);
+    break;
+    case A_DEVICE:
+      for(u8 i = 0; i < a->len; i++) peer_device_send(a->port, a->bytes[i]);
+    break;
+    case A_INHIBIT:
+      sim_log("%s: inhibit for %u us", peer_name(a->port), a->arg);
+      peer_inhibit(a->port, a->arg);
+    break;
+  }
+}
+
+int compare_actions(const void* a, const void* b) {
+  const sim_action* x = a;
+  const sim_action* y = b;
+  if(x->t != y->t) return x->t < y->t ? -1 : 1;
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+void run(u64 end) {
+  static u32 next_action = 0;
+  static u64 next_task = 0;
+
+  while(1) {
+    u64 t = end;
+    if(sim_pio_next() < t) t = sim_pio_next();
+    if(peer_next() < t) t = peer_next();
+    if(next_task < t) t = next_task;
+    if(next_action < action_count && actions[next_action].t < t) t = actions[next_action].t;
+    if(t < sim_now) t = sim_now;
+    sim_now = t;
+
+    while(next_action < action_count && actions[next_action].t <= t) {
+      run_action(&actions[next_action++]);
+    }
+
+    sim_pio_step(t);
+    sim_irq_dispatch();
+    peer_step(t);
+
+    if(t >= next_task) {
+      fw_task();
+      next_task = t + SIM_US(fw_loop_us);
+    }
+
+    if(t >= end) break;
+  }
+}
+
+// port -1 merges all ports
+sim_stat port_stat(s8 port, u8 stat) {
+  if(port >= 0) return sim_stats[port][stat];
+  sim_stat m;
+  memset(&m, 0, sizeof(m));
+  for(u8 i = 0; i < sim_ports; i++) {
+    sim_stat* s = &sim_stats[i][stat];
+    if(!s->n) continue;
+    if(!m.n || s->min < m.min) m.min = s->min;
+    if(!m.n || s->max > m.max) m.max = s->max;
+    m.sum += s->sum;
+    m.n += s->n;
+    for(u8 b = 0; b < SIM_HIST; b++) m.hist[b] += s->hist[b];
+    m.print_hist |= s->print_hist;
+  }
+  return m;
+}
+
+u32 port_sum(s8 port, u32* values) {
+  if(port >= 0) return values[port];
+  u32 sum = 0;
+  for(u8 i = 0; i < sim_ports; i++) sum += values[i];
+  return sum;
+}
+
+ps2out_hist* fw_hist(u8 port, const char* name) {
+  if(!strcmp(name, "input")) return &fw_out[port].input;
+  if(!strcmp(name, "queue")) return &fw_out[port].queue;
+  if(!strcmp(name, "bus")) return &fw_out[port].bus;
+  if(!strcmp(name, "ack")) return &fw_out[port].ack;
+  return NULL;
+}
+
+// max or total count of a ps2out histogram, name is e.g. "bus_max"
+bool fw_hist_value(s8 port, const char* name, double* value) {
+  char hist[8];
+  const char* suffix = strchr(name, '_');
+  if(!suffix || suffix - name >= (int)sizeof(hist)) return false;
+  snprintf(hist, suffix - name + 1, "%s", name);
+  if(!fw_hist(0, hist) || (strcmp(suffix, "_max") && strcmp(suffix, "_n"))) return false;
+
+  *value = 0;
+  for(u8 i = 0; i < sim_ports; i++) {
+    if(port >= 0 && port != i) continue;
+    ps2out_hist* h = fw_hist(i, hist);
+    if(!strcmp(suffix, "_max")) {
+      if(h->max > *value) *value = h->max;
+    } else {
+      for(u8 b = 0; b < PS2OUT_HIST; b++) *value += h->count[b];
+    }
+  }
+  return true;
+}
+
+double stat_value(const char* name, bool* found) {
+  s8 port = -1;
+  if(name[0] >= '0' && name[0] < '0' + sim_ports && name[1] == '.') {
+    port = name[0] - '0';
+    name += 2;
+  }
+
+  *found = true;
+  if(!strcmp(name, "bytes")) return port_sum(port, sim_bytes);
+  if(!strcmp(name, "errors")) return sim_errors;
+  if(!strcmp(name, "queued")) return port_sum(port, sim_queued);
+  if(!strcmp(name, "restarts")) return port_sum(port, sim_restarts);
+  if(!strcmp(name, "fw_retries") || !strcmp(name, "fw_retried")) {
+    bool bytes = !strcmp(name, "fw_retries");
+    u32 sum = 0;
+    for(u8 i = 0; i < sim_ports; i++) {
+      if(port < 0 || port == i) sum += bytes ? fw_out[i].retries : fw_out[i].retried;
+    }
+    return sum;
+  }
+  if(!strcmp(name, "rate")) return sim_now ? port_sum(port, sim_bytes) / (SIM_TO_US(sim_now) / 1000000) : 0;
+
+  double fw;
+  if(!strncmp(name, "fw_", 3) && fw_ps2out && fw_hist_value(port, name + 3, &fw)) return fw;
+
+  for(u8 i = 0; i < ST_COUNT; i++) {
+    size_t len = strlen(sim_stat_names[i]);
+    if(!strncmp(name, sim_stat_names[i], len) && name[len] == '_') {
+      sim_stat s = port_stat(port, i);
+      if(!strcmp(name + len, "_min")) return s.min;
+      if(!strcmp(name + len, "_max")) return s.max;
+      if(!strcmp(name + len, "_avg")) return s.n ? s.sum / s.n : 0;
+      if(!strcmp(name + len, "_n")) return s.n;
+    }
+  }
+
+  *found = false;
+  return 0;
+}
+
+void print_port(s8 port) {
+  char name[16];
+  for(u8 i = 0; i < ST_COUNT; i++) {
+    sim_stat s = port_stat(port, i);
+    if(!s.n) continue;
+    if(port < 0) {
+      snprintf(name, sizeof(name), "%s", sim_stat_names[i]);
+    } else {
+      snprintf(name, sizeof(name), "%d.%s", port, sim_stat_names[i]);
+    }
+    printf("%-8s %9.2f .. %9.2f us  avg %9.2f  (n=%u)\n", name, s.min, s.max, s.sum / s.n, s.n);
+    if(!s.print_hist) continue;
+    for(u8 b = 0; b < SIM_HIST; b++) {
+      if(!s.hist[b]) continue;
+      if(b < SIM_HIST - 1) {
+        printf("  < %5u us %6u\n", 8u << b, s.hist[b]);
+      } else {
+        printf("  >=%5u us %6u\n", 8u << (b - 1), s.hist[b]);
+      }
+    }
+  }
+}
+
+void print_stats() {
+  printf("bytes    %u  (%.1f bytes/s)\n", port_sum(-1, sim_bytes), stat_value("rate", &(bool){0}));
+  printf("queued   %u\n", port_sum(-1, sim_queued));
+  if(port_sum(-1, sim_restarts)) printf("restarts %u\n", port_sum(-1, sim_restarts));
+  printf("errors   %u\n", sim_errors);
+  print_port(-1);
+  if(fw_ps2out) {
+    const char* hists[] = { "input", "queue", "bus", "ack" };
+    printf("firmware");
+    for(u8 i = 0; i < 4; i++) {
+      double max, n;
+      char name[16];
+      snprintf(name, sizeof(name), "%s_max", hists[i]);
+      fw_hist_value(-1, name, &max);
+      snprintf(name, sizeof(name), "%s_n", hists[i]);
+      fw_hist_value(-1, name, &n);
+      if(n) printf("  %s max %g (n=%g)", hists[i], max, n);
+    }
+    printf("\n");
+    for(u8 port = 0; port < sim_ports; port++) {
+      for(u8 i = 0; i < PS2OUT_CMDS && fw_out[port].cmds[i].count; i++) {
+        ps2out_cmd* cmd = &fw_out[port].cmds[i];
+        printf("firmware%s reply to %02x  avg %u max %u (n=%u)\n", port ? "1" : "", cmd->cmd,
+          (uint)(cmd->sum / cmd->count), (uint)cmd->max, (uint)cmd->count);
+      }
+    }
+  }
+  if(sim_ports == 1) return;
+
+  char rate[16];
+  for(u8 port = 0; port < sim_ports; port++) {
+    snprintf(rate, sizeof(rate), "%u.rate", port);
+    printf("port %u: bytes %u  (%.1f bytes/s)  queued %u\n", port, sim_bytes[port], stat_value(rate, &(bool){0}), sim_queued[port]);
+    print_port(port);
+  }
+}
+
+int check_expects() {
+  int failed = 0;
+  for(u8 i = 0; i < expect_count; i++) {
+    sim_expect* e = &expects[i];
+    bool found, ref;
+    double v = stat_value(e->stat, &found);
+    double w = stat_value(e->value, &ref);
+    if(!ref) w = atof(e->value);
+    bool ok = found && (
+      (!strcmp(e->op, "<") && v < w) || (!strcmp(e->op, "<=") && v <= w) ||
+      (!strcmp(e->op, ">") && v > w) || (!strcmp(e->op, ">=") && v >= w) ||
+      (!strcmp(e->op, "==") && v == w));
+    printf("expect %s %s %s: %s (%g)\n", e->stat, e->op, e->value, ok ? "ok" : "FAILED", v);
+    if(!ok) failed = 1;
+  }
+  return failed;
+}
+
+bool parse_line(char* line) {
+  char* tok[24];
+  u8 n = 0;
+  for(char* t = strtok(line, " \t\r\n"); t && n < 24; t = strtok(NULL, " \t\r\n")) {
+    if(t[0] == '#') break;
+    tok[n++] = t;
+  }
+  if(!n) return true;
+
+  if(!strcmp(tok[0], "program") && n == 2) {
+    fw_ps2out = !strcmp(tok[1], "ps2out");
+    peer_is_host = fw_ps2out;
+  } else if(!strcmp(tok[0], "ports") && n == 2) {
+    sim_ports = atoi(tok[1]);
+    if(sim_ports < 1 || sim_ports > SIM_PORTS) return false;
+  } else if(!strcmp(tok[0], "sm") && n == 2) {
+    fw_sm = atoi(tok[1]);
+  } else if(!strcmp(tok[0], "loop") && n == 2) {
+    fw_loop_us = atoi(tok[1]);
+  } else if(!strcmp(tok[0], "gap") && n == 2) {
+    fw_gap_us = atoi(tok[1]);
+  } else if(!strcmp(tok[0], "hold") && n == 2) {
+    peer_hold_us = atoi(tok[1]);
+  } else if(!strcmp(tok[0], "devclk") && n == 2) {
+    peer_half_us = atoi(tok[1]);
+  } else if(!strcmp(tok[0], "histogram") && n == 2) {
+    u8 i = 0;
+    while(i < ST_COUNT && strcmp(tok[1], sim_stat_names[i])) i++;
+    if(i == ST_COUNT) return false;
+    for(u8 port = 0; port < SIM_PORTS; port++) sim_stats[port][i].print_hist = true;
+  } else if(!strcmp(tok[0], "trace") && n == 2) {
+    sim_trace = !strcmp(tok[1], "on");
+  } else if(!strcmp(tok[0], "reply") && n >= 2 && n <= 17) {
+    u8 byte = strtoul(tok[1], NULL, 16);
+    sim_reply[byte][0] = n - 2;
+    for(u8 i = 2; i < n; i++) sim_reply[byte][i - 1] = strtoul(tok[i], NULL, 16);
+  } else if(!strcmp(tok[0], "argument") && n == 2) {
+    sim_argument[strtoul(tok[1], NULL, 16) & 0xff] = true;
+  } else if(!strcmp(tok[0], "run") && n == 2) {
+    sim_end = SIM_US(atof(tok[1]));
+  } else if(!strcmp(tok[0], "expect") && n == 4 && expect_count < 32) {
+    snprintf(expects[expect_count].stat, sizeof(expects[0].stat), "%s", tok[1]);
+    snprintf(expects[expect_count].op, sizeof(expects[0].op), "%s", tok[2]);
+    snprintf(expects[expect_count++].value, sizeof(expects[0].value), "%s", tok[3]);
+  } else if(!strcmp(tok[0], "at") && n >= 3) {
+    sim_action a;
+    memset(&a, 0, sizeof(a));
+    a.t = SIM_US(atof(tok[1]));
+    u8 i = 2;
+    u64 every = 0;
+    u32 count = 1;
+    if(!strcmp(tok[i], "every") && n >= 6) {
+      every = SIM_US(atof(tok[i + 1]));
+      count = atoi(tok[i + 2]);
+      i += 3;
+    }
+
+    if(!strcmp(tok[i], "port") && n >= i + 3) {
+      a.port = atoi(tok[i + 1]);
+      if(a.port >= SIM_PORTS) return false;
+      i += 2;
+    }
+
+    if(!strcmp(tok[i], "send")) a.cmd = A_SEND;
+    else if(!strcmp(tok[i], "reply")) a.cmd = A_REPLY;
+    else if(!strcmp(tok[i], "host")) a.cmd = A_HOST;
+    else if(!strcmp(tok[i], "device")) a.cmd = A_DEVICE;
+    else if(!strcmp(tok[i], "inhibit")) a.cmd = A_INHIBIT;
+    else return false;
+
+    if(a.cmd == A_INHIBIT) {
+      if(n != i + 2) return false;
+      a.arg = atoi(tok[i + 1]);
+    } else {
+      for(i++; i < n && a.len < 16; i++) a.bytes[a.len++] = strtoul(tok[i], NULL, 16);
+      if(!a.len) return false;
+    }
+
+    actions = realloc(actions, (action_count + count) * sizeof(sim_action));
+    for(u32 r = 0; r < count; r++) {
+      actions[action_count] = a;
+      actions[action_count].seq = action_count;
+      actions[action_count++].t = a.t + r * every;
+    }
+  } else {
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  const char* path = NULL;
+  for(int i = 1; i < argc; i++) {
+    if(!strcmp(argv[i], "-v")) {
+      sim_trace = true;
+    } else {
+      path = argv[i];
+    }
+  }
+
+  if(!path) {
+    printf("usage: piosim [-v] script.sim\n");
+    return 2;
+  }
+
+  FILE* f = fopen(path, "r");
+  if(!f) {
+    printf("piosim: cannot open %s\n", path);
+    return 2;
+  }
+
+  char line[256];
+  u32 lineno = 0;
+  while(fgets(line, sizeof(line), f)) {
+    lineno++;
+    if(!parse_line(line)) {
+      printf("piosim: %s:%u: syntax error\n", path, lineno);
+      return 2;
+    }
+  }
+  fclose(f);
+
+  qsort(actions, action_count, sizeof(sim_action), compare_actions);
+
+  fw_init();
+  run(sim_end);
+  print_stats();
+  return check_expects();
+}
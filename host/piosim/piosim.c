@@ -0,0 +1,621 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 No0ne (https://github.com/No0ne)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "piosim.h"
+
+pio_hw_t sim_pio[2];
+pio_hw_t* pio0 = &sim_pio[0];
+pio_hw_t* pio1 = &sim_pio[1];
+
+u64 sim_now = 0;
+bool sim_pio_dir[SIM_PINS];
+bool sim_pio_value[SIM_PINS];
+bool sim_peer_low[SIM_PINS];
+
+bool sim_exec(PIO pio, u8 smi, u16 instr);
+
+bool sim_pin(u8 pin) {
+  pin %= SIM_PINS;
+  return !((sim_pio_dir[pin] && !sim_pio_value[pin]) || sim_peer_low[pin]);
+}
+
+void sim_set_pindir(u8 pin, bool out) {
+  sim_pio_dir[pin % SIM_PINS] = out;
+}
+
+void sim_set_pin(u8 pin, bool value) {
+  sim_pio_value[pin % SIM_PINS] = value;
+}
+
+pio_sm_config pio_get_default_sm_config() {
+  pio_sm_config c;
+  memset(&c, 0, sizeof(c));
+  c.clkdiv = 1;
+  c.wrap = 31;
+  c.out_right = true;
+  c.in_right = true;
+  return c;
+}
+
+void sm_config_set_wrap(pio_sm_config* c, uint wrap_target, uint wrap) {
+  c->wrap_target = wrap_target;
+  c->wrap = wrap;
+}
+
+void sm_config_set_sideset(pio_sm_config* c, uint bit_count, bool optional, bool pindirs) {
+  c->sideset_bits = bit_count;
+  c->sideset_opt = optional;
+  c->sideset_pindirs = pindirs;
+}
+
+void sm_config_set_sideset_pins(pio_sm_config* c, uint sideset_base) {
+  c->sideset_base = sideset_base;
+}
+
+void sm_config_set_clkdiv(pio_sm_config* c, float div) {
+  c->clkdiv = div;
+}
+
+void sm_config_set_jmp_pin(pio_sm_config* c, uint pin) {
+  c->jmp_pin = pin;
+}
+
+void sm_config_set_set_pins(pio_sm_config* c, uint set_base, uint set_count) {
+  c->set_base = set_base;
+  c->set_count = set_count;
+}
+
+void sm_config_set_out_pins(pio_sm_config* c, uint out_base, uint out_count) {
+  c->out_base = out_base;
+  c->out_count = out_count;
+}
+
+void sm_config_set_in_pins(pio_sm_config* c, uint in_base) {
+  c->in_base = in_base;
+}
+
+void sm_config_set_out_shift(pio_sm_config* c, bool shift_right, bool autopull, uint pull_threshold) {
+  c->out_right = shift_right;
+  c->autopull = autopull;
+  c->pull_thresh = pull_threshold ? pull_threshold : 32;
+}
+
+void sm_config_set_in_shift(pio_sm_config* c, bool shift_right, bool autopush, uint push_threshold) {
+  c->in_right = shift_right;
+  c->autopush = autopush;
+  c->push_thresh = push_threshold ? push_threshold : 32;
+}
+
+uint pio_add_program(PIO pio, const struct pio_program* program) {
+  uint offset = pio->used;
+  // programs are assembled relative to 0, relocate the jump targets
+  for(u8 i = 0; i < program->length; i++) {
+    u16 instr = program->instructions[i];
+    if(!(instr >> 13)) instr += offset;
+    pio->instr_mem[offset + i] = instr;
+  }
+  pio->used += program->length;
+  return offset;
+}
+
+int pio_claim_unused_sm(PIO pio, bool required) {
+  for(u8 i = 0; i < 4; i++) {
+    if(!pio->sm[i].claimed) {
+      pio->sm[i].claimed = true;
+      return i;
+    }
+  }
+  if(required) {
+    printf("piosim: no free state machine\n");
+    exit(2);
+  }
+  return -1;
+}
+
+void pio_gpio_init(PIO pio, uint pin) {
+  (void)pio;
+  sim_set_pin(pin, 0);
+  sim_set_pindir(pin, 0);
+}
+
+void pio_sm_init(PIO pio, uint sm, uint initial_pc, const pio_sm_config* config) {
+  pio_sm_hw_t* s = &pio->sm[sm];
+  bool claimed = s->claimed;
+  memset(s, 0, sizeof(pio_sm_hw_t));
+  s->claimed = claimed;
+  s->prog = pio->instr_mem;
+  s->c = *config;
+  s->pc = initial_pc;
+  s->div = config->clkdiv < 1 ? 1 : (u32)config->clkdiv;
+  s->osr_count = 32;
+}
+
+void pio_sm_set_enabled(PIO pio, uint sm, bool enabled) {
+  pio->sm[sm].enabled = enabled;
+  pio->sm[sm].next = sim_now + pio->sm[sm].div;
+}
+
+void pio_sm_put(PIO pio, uint sm, uint32_t data) {
+  pio_sm_hw_t* s = &pio->sm[sm];
+  // like the hardware, a write to a full FIFO is lost
+  if(s->tx_level < 4) s->txf[s->tx_level++] = data;
+}
+
+uint32_t pio_sm_get(PIO pio, uint sm) {
+  pio_sm_hw_t* s = &pio->sm[sm];
+  if(!s->rx_level) return 0xffffffff;
+  u32 data = s->rxf[0];
+  s->rx_level--;
+  memmove(s->rxf, s->rxf + 1, s->rx_level * sizeof(u32));
+  return data;
+}
+
+bool pio_sm_is_rx_fifo_empty(PIO pio, uint sm) {
+  return !pio->sm[sm].rx_level;
+}
+
+bool pio_sm_is_tx_fifo_full(PIO pio, uint sm) {
+  return pio->sm[sm].tx_level == 4;
+}
+
+uint pio_sm_get_tx_fifo_level(PIO pio, uint sm) {
+  return pio->sm[sm].tx_level;
+}
+
+bool pio_interrupt_get(PIO pio, uint irq) {
+  return pio->irq >> irq & 1;
+}
+
+void pio_interrupt_clear(PIO pio, uint irq) {
+  pio->irq &= ~(1 << irq);
+}
+
+void pio_set_irq0_source_enabled(PIO pio, enum pio_interrupt_source source, bool enabled) {
+  if(enabled) {
+    pio->inte0 |= 1u << source;
+  } else {
+    pio->inte0 &= ~(1u << source);
+  }
+}
+
+uint pio_get_index(PIO pio) {
+  return pio == pio1;
+}
+
+// DREQ numbering like the RP2040, TX0-3 then RX0-3 per PIO
+uint pio_get_dreq(PIO pio, uint sm, bool is_tx) {
+  return pio_get_index(pio) * 8 + (is_tx ? 0 : 4) + sm;
+}
+
+bool pio_sm_is_tx_fifo_empty(PIO pio, uint sm) {
+  return !pio->sm[sm].tx_level;
+}
+
+void pio_sm_clear_fifos(PIO pio, uint sm) {
+  pio->sm[sm].tx_level = 0;
+  pio->sm[sm].rx_level = 0;
+}
+
+// The SDK pulls the remaining words through the OSR with exec'd pulls,
+// the last one is left in the OSR
+void pio_sm_drain_tx_fifo(PIO pio, uint sm) {
+  pio_sm_hw_t* s = &pio->sm[sm];
+  if(!s->tx_level) return;
+  s->osr = s->txf[s->tx_level - 1];
+  s->osr_count = 0;
+  s->tx_level = 0;
+}
+
+void pio_sm_restart(PIO pio, uint sm) {
+  pio_sm_hw_t* s = &pio->sm[sm];
+  s->isr = 0;
+  s->isr_count = 0;
+  s->osr_count = 32;
+  s->delay = 0;
+  s->irq_wait = false;
+}
+
+void pio_sm_exec(PIO pio, uint sm, uint instr) {
+  pio_sm_hw_t* s = &pio->sm[sm];
+  u8 pc = s->pc;
+  sim_exec(pio, sm, instr);
+  if(instr >> 13) s->pc = pc;
+}
+
+uint8_t pio_sm_get_pc(PIO pio, uint sm) {
+  return pio->sm[sm].pc;
+}
+
+dma_channel_hw_t sim_dma[SIM_DMA_CHANNELS];
+
+int dma_claim_unused_channel(bool required) {
+  for(u8 i = 0; i < SIM_DMA_CHANNELS; i++) {
+    if(!sim_dma[i].claimed) {
+      sim_dma[i].claimed = true;
+      return i;
+    }
+  }
+  if(required) {
+    printf("piosim: no free DMA channel\n");
+    exit(2);
+  }
+  return -1;
+}
+
+// Transfer size and write increment are ignored, every transfer is one word into a TX FIFO
+dma_channel_config dma_channel_get_default_config(uint channel) {
+  dma_channel_config c = { 0x3f, true };
+  (void)channel;
+  return c;
+}
+
+void channel_config_set_transfer_data_size(dma_channel_config* c, enum dma_channel_transfer_size size) {
+  (void)c;
+  (void)size;
+}
+
+void channel_config_set_read_increment(dma_channel_config* c, bool incr) {
+  c->read_increment = incr;
+}
+
+void channel_config_set_write_increment(dma_channel_config* c, bool incr) {
+  (void)c;
+  (void)incr;
+}
+
+void channel_config_set_dreq(dma_channel_config* c, uint dreq) {
+  c->dreq = dreq;
+}
+
+void dma_channel_configure(uint channel, const dma_channel_config* config, volatile void* write_addr, const volatile void* read_addr, uint transfer_count, bool trigger) {
+  dma_channel_hw_t* d = &sim_dma[channel];
+  (void)write_addr;
+  d->dreq = config->dreq;
+  d->read_increment = config->read_increment;
+  d->read_addr = (const u32*)read_addr;
+  d->transfer_count = transfer_count;
+  d->busy = trigger && transfer_count;
+}
+
+void dma_channel_transfer_from_buffer_now(uint channel, const volatile void* read_addr, uint32_t transfer_count) {
+  sim_dma[channel].read_addr = (const u32*)read_addr;
+  sim_dma[channel].transfer_count = transfer_count;
+  sim_dma[channel].busy = transfer_count != 0;
+}
+
+// Like the hardware, the transfer count keeps what was left when the channel was stopped
+void dma_channel_abort(uint channel) {
+  sim_dma[channel].busy = false;
+}
+
+bool dma_channel_is_busy(uint channel) {
+  return sim_dma[channel].busy;
+}
+
+dma_channel_hw_t* dma_channel_hw_addr(uint channel) {
+  return &sim_dma[channel];
+}
+
+// Only PIO TX DREQs are modelled, a channel moves a word whenever the FIFO has room
+void sim_dma_step() {
+  for(u8 i = 0; i < SIM_DMA_CHANNELS; i++) {
+    dma_channel_hw_t* d = &sim_dma[i];
+    if(!d->busy || d->dreq >= 16 || d->dreq & 4) continue;
+    PIO pio = d->dreq >> 3 ? pio1 : pio0;
+    u8 sm = d->dreq & 3;
+    while(d->transfer_count && pio->sm[sm].tx_level < 4) {
+      pio_sm_put(pio, sm, *d->read_addr);
+      if(d->read_increment) d->read_addr++;
+      d->busy = --d->transfer_count != 0;
+    }
+  }
+}
+
+irq_handler_t sim_irq_handlers[SIM_IRQS];
+bool sim_irq_enabled[SIM_IRQS];
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler) {
+  sim_irq_handlers[num] = handler;
+}
+
+void irq_set_enabled(uint num, bool enabled) {
+  sim_irq_enabled[num] = enabled;
+}
+
+u32 time_us_32() {
+  return SIM_TO_US(sim_now);
+}
+
+u64 time_us_64() {
+  return SIM_TO_US(sim_now);
+}
+
+// Level triggered like the NVIC, a handler runs until its sources are cleared
+void sim_irq_dispatch() {
+  for(u8 p = 0; p < 2; p++) {
+    u8 num = p ? PIO1_IRQ_0 : PIO0_IRQ_0;
+    if(!sim_irq_enabled[num] || !sim_irq_handlers[num]) continue;
+
+    for(u8 n = 0; n < 8; n++) {
+      u32 intr = (u32)(sim_pio[p].irq & 0x0f) << pis_interrupt0;
+      for(u8 i = 0; i < 4; i++) {
+        if(sim_pio[p].sm[i].rx_level) intr |= 1u << (pis_sm0_rx_fifo_not_empty + i);
+        if(sim_pio[p].sm[i].tx_level < 4) intr |= 1u << (pis_sm0_tx_fifo_not_full + i);
+      }
+      if(!(intr & sim_pio[p].inte0)) break;
+      sim_irq_handlers[num]();
+    }
+  }
+}
+
+u32 pio_sm_get_tx(PIO pio, u8 smi) {
+  pio_sm_hw_t* s = &pio->sm[smi];
+  u32 data = s->txf[0];
+  s->tx_level--;
+  memmove(s->txf, s->txf + 1, s->tx_level * sizeof(u32));
+  return data;
+}
+
+u8 sim_irq_index(u8 index, u8 sm) {
+  if(index & 0x10) return (index & 4) | ((index + sm) & 3);
+  return index & 7;
+}
+
+u32 sim_read_pins(u8 base) {
+  u32 value = 0;
+  for(u8 i = 0; i < 32; i++) {
+    value |= sim_pin(base + i) << i;
+  }
+  return value;
+}
+
+u32 sim_bitrev(u32 v) {
+  u32 r = 0;
+  for(u8 i = 0; i < 32; i++) {
+    r |= (v >> i & 1) << (31 - i);
+  }
+  return r;
+}
+
+// Executes the current instruction, returns false if it stalled
+bool sim_exec(PIO pio, u8 smi, u16 instr) {
+  pio_sm_hw_t* s = &pio->sm[smi];
+  u8 op = instr >> 13;
+  u8 a = instr >> 5 & 7;
+  u8 idx = instr & 0x1f;
+  u8 n = idx ? idx : 32;
+  u32 mask = n == 32 ? 0xffffffff : ((1u << n) - 1);
+  u32 data;
+
+  switch(op) {
+    case 0: // JMP
+      switch(a) {
+        case 0: data = 1; break;
+        case 1: data = !s->x; break;
+        case 2: data = s->x != 0; s->x--; break;
+        case 3: data = !s->y; break;
+        case 4: data = s->y != 0; s->y--; break;
+        case 5: data = s->x != s->y; break;
+        case 6: data = sim_pin(s->c.jmp_pin); break;
+        default: data = s->osr_count < s->c.pull_thresh; break;
+      }
+      if(data) {
+        s->pc = idx;
+        return true;
+      }
+    break;
+
+    case 1: { // WAIT
+      bool pol = instr >> 7 & 1;
+      switch(a & 3) {
+        case 0: if(sim_pin(idx) != pol) return false; break;
+        case 1: if(sim_pin(s->c.in_base + idx) != pol) return false; break;
+        case 2: {
+          u8 irq = sim_irq_index(idx, smi);
+          if(pio_interrupt_get(pio, irq) != pol) return false;
+          if(pol) pio_interrupt_clear(pio, irq);
+        } break;
+      }
+    } break;
+
+    case 2: // IN
+      if(s->c.autopush && s->isr_count + n >= s->c.push_thresh && s->rx_level == 4) return false;
+      switch(a) {
+        case 0: data = sim_read_pins(s->c.in_base); break;
+        case 1: data = s->x; break;
+        case 2: data = s->y; break;
+        case 6: data = s->isr; break;
+        case 7: data = s->osr; break;
+        default: data = 0; break;
+      }
+      data &= mask;
+      if(s->c.in_right) {
+        s->isr = n == 32 ? data : (s->isr >> n) | (data << (32 - n));
+      } else {
+        s->isr = n == 32 ? data : (s->isr << n) | data;
+      }
+      s->isr_count = s->isr_count + n > 32 ? 32 : s->isr_count + n;
+      if(s->c.autopush && s->isr_count >= s->c.push_thresh) {
+        s->rxf[s->rx_level++] = s->isr;
+        s->isr = 0;
+        s->isr_count = 0;
+      }
+    break;
+
+    case 3: // OUT
+      if(s->c.autopull && s->osr_count >= s->c.pull_thresh) {
+        if(!s->tx_level) return false;
+        s->osr = pio_sm_get_tx(pio, smi);
+        s->osr_count = 0;
+      }
+      if(s->c.out_right) {
+        data = s->osr & mask;
+        s->osr = n == 32 ? 0 : s->osr >> n;
+      } else {
+        data = n == 32 ? s->osr : s->osr >> (32 - n);
+        s->osr = n == 32 ? 0 : s->osr << n;
+      }
+      s->osr_count = s->osr_count + n > 32 ? 32 : s->osr_count + n;
+      switch(a) {
+        case 0: for(u8 i = 0; i < s->c.out_count; i++) sim_set_pin(s->c.out_base + i, data >> i & 1); break;
+        case 1: s->x = data; break;
+        case 2: s->y = data; break;
+        case 4: for(u8 i = 0; i < s->c.out_count; i++) sim_set_pindir(s->c.out_base + i, data >> i & 1); break;
+        case 5: s->pc = data & 0x1f; return true;
+        case 6: s->isr = data; s->isr_count = n; break;
+        default: break;
+      }
+    break;
+
+    case 4: // PUSH / PULL
+      if(instr >> 7 & 1) {
+        if(instr >> 6 & 1 && s->osr_count < s->c.pull_thresh) break;
+        if(!s->tx_level) {
+          if(instr >> 5 & 1) return false;
+          s->osr = s->x;
+        } else {
+          s->osr = pio_sm_get_tx(pio, smi);
+        }
+        s->osr_count = 0;
+      } else {
+        if(instr >> 6 & 1 && s->isr_count < s->c.push_thresh) break;
+        if(s->rx_level == 4) {
+          if(instr >> 5 & 1) return false;
+        } else {
+          s->rxf[s->rx_level++] = s->isr;
+        }
+        s->isr = 0;
+        s->isr_count = 0;
+      }
+    break;
+
+    case 5: { // MOV
+      switch(instr & 7) {
+        case 0: data = sim_read_pins(s->c.in_base); break;
+        case 1: data = s->x; break;
+        case 2: data = s->y; break;
+        case 6: data = s->isr; break;
+        case 7: data = s->osr; break;
+        default: data = 0; break;
+      }
+      switch(instr >> 3 & 3) {
+        case 1: data = ~data; break;
+        case 2: data = sim_bitrev(data); break;
+      }
+      switch(a) {
+        case 0: for(u8 i = 0; i < s->c.out_count; i++) sim_set_pin(s->c.out_base + i, data >> i & 1); break;
+        case 1: s->x = data; break;
+        case 2: s->y = data; break;
+        case 5: s->pc = data & 0x1f; return true;
+        case 6: s->isr = data; s->isr_count = 0; break;
+        case 7: s->osr = data; s->osr_count = 0; break;
+        default: break;
+      }
+    } break;
+
+    case 6: { // IRQ
+      u8 irq = sim_irq_index(idx, smi);
+      if(instr >> 6 & 1) {
+        pio_interrupt_clear(pio, irq);
+      } else if(instr >> 5 & 1) {
+        if(!s->irq_wait) {
+          pio->irq |= 1 << irq;
+          s->irq_wait = true;
+        }
+        if(pio_interrupt_get(pio, irq)) return false;
+        s->irq_wait = false;
+      } else {
+        pio->irq |= 1 << irq;
+      }
+    } break;
+
+    case 7: // SET
+      switch(a) {
+        case 0: for(u8 i = 0; i < s->c.set_count; i++) sim_set_pin(s->c.set_base + i, idx >> i & 1); break;
+        case 1: s->x = idx; break;
+        case 2: s->y = idx; break;
+        case 4: for(u8 i = 0; i < s->c.set_count; i++) sim_set_pindir(s->c.set_base + i, idx >> i & 1); break;
+      }
+    break;
+  }
+
+  s->pc = s->pc == s->c.wrap ? s->c.wrap_target : (u8)(s->pc + 1);
+  return true;
+}
+
+void sim_tick(PIO pio, u8 smi) {
+  pio_sm_hw_t* s = &pio->sm[smi];
+
+  if(s->delay) {
+    s->delay--;
+    return;
+  }
+
+  // autopull refills an empty OSR in the background, this is what makes jmp !osre work
+  if(s->c.autopull && s->osr_count >= s->c.pull_thresh && s->tx_level) {
+    s->osr = pio_sm_get_tx(pio, smi);
+    s->osr_count = 0;
+  }
+
+  u16 instr = s->prog[s->pc];
+  u8 ss = s->c.sideset_bits;
+  u8 field = instr >> 8 & 0x1f;
+  u8 delay = field & ((1 << (5 - ss)) - 1);
+  u8 side = field >> (5 - ss);
+
+  if(ss && (!s->c.sideset_opt || side >> (ss - 1) & 1)) {
+    for(u8 i = 0; i < ss - s->c.sideset_opt; i++) {
+      if(s->c.sideset_pindirs) {
+        sim_set_pindir(s->c.sideset_base + i, side >> i & 1);
+      } else {
+        sim_set_pin(s->c.sideset_base + i, side >> i & 1);
+      }
+    }
+  }
+
+  if(sim_exec(pio, smi, instr)) s->delay = delay;
+}
+
+u64 sim_pio_next() {
+  u64 next = UINT64_MAX;
+  for(u8 p = 0; p < 2; p++) {
+    for(u8 i = 0; i < 4; i++) {
+      if(sim_pio[p].sm[i].enabled && sim_pio[p].sm[i].next < next) next = sim_pio[p].sm[i].next;
+    }
+  }
+  return next;
+}
+
+void sim_pio_step(u64 now) {
+  for(u8 p = 0; p < 2; p++) {
+    for(u8 i = 0; i < 4; i++) {
+      pio_sm_hw_t* s = &sim_pio[p].sm[i];
+      if(s->enabled && s->next <= now) {
+        sim_tick(&sim_pio[p], i);
+        s->next += s->div;
+      }
+    }
+  }
+  sim_dma_step();
+}
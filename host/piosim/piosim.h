@@ -0,0 +1,97 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 No0ne (https://github.com/No0ne)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#ifndef _PIOSIM_H
+#define _PIOSIM_H
+
+#include "hal_pico.h"
+#include "hardware/irq.h"
+#include "hardware/dma.h"
+
+// Virtual time is counted in system clock cycles.
+#define SIM_SYS_HZ 125000000
+#define SIM_US(us) ((u64)((us) * (SIM_SYS_HZ / 1000000)))
+#define SIM_TO_US(t) ((double)(t) / (SIM_SYS_HZ / 1000000))
+
+// The simulated GPIOs are open-collector lines with a pull-up.
+// Both the PIO (pindir set, output 0) and the far end can pull them low.
+#define SIM_PINS 32
+
+extern u64 sim_now;
+extern bool sim_peer_low[SIM_PINS];
+
+bool sim_pin(u8 pin);
+u64 sim_pio_next();
+void sim_pio_step(u64 now);
+void sim_irq_dispatch();
+
+// Port n uses GPIO 2n for data and 2n + 1 for clock, each with its own state machine
+#define SIM_PORTS 2
+#define SIM_DAT(port) ((port) * 2)
+#define SIM_CLK(port) (SIM_DAT(port) + 1)
+
+extern u8 sim_ports;
+
+// hist[n] counts samples below 8 << n µs, the last bucket everything above
+#define SIM_HIST 12
+
+typedef struct {
+  double min;
+  double max;
+  double sum;
+  u32 n;
+  u32 hist[SIM_HIST];
+  bool print_hist;
+} sim_stat;
+
+// lat is the time from ps2out_send() to the start bit of the packet's first byte
+enum { ST_BIT, ST_BYTE, ST_GAP, ST_RTS, ST_ACK, ST_INHIBIT, ST_LAT, ST_REPLY, ST_COUNT };
+
+extern sim_stat sim_stats[SIM_PORTS][ST_COUNT];
+extern u32 sim_bytes[SIM_PORTS];
+extern u32 sim_errors;
+extern u32 sim_pending[SIM_PORTS];
+extern bool sim_trace;
+extern u8 sim_reply[256][16];
+
+void sim_stat_add(u8 port, u8 stat, double us);
+void sim_packet_start(u8 port);
+void sim_packet_byte(u8 port, u8 byte);
+void sim_resend(u8 port);
+void sim_log(const char* fmt, ...);
+
+// The far end of the bus, a PS/2 host when the firmware side is ps2out
+// and a PS/2 device when it is ps2in.
+extern bool peer_is_host;
+extern u16 peer_half_us;
+extern u32 peer_hold_us;
+
+const char* peer_name(u8 port);
+void peer_host_send(u8 port, u8 byte);
+void peer_inhibit(u8 port, u32 us);
+void peer_device_send(u8 port, u8 byte);
+u64 peer_next();
+void peer_step(u64 now);
+
+#endif
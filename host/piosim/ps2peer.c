@@ -0,0 +1,350 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 No0ne (https://github.com/No0ne)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "piosim.h"
+
+bool peer_is_host = true;
+u16 peer_half_us = 40;
+u32 peer_hold_us = 0;
+
+enum { PH_IDLE, PH_RTS, PH_RTS_DATA, PH_SEND, PH_INHIBIT };
+enum { PD_IDLE, PD_TX, PD_RX };
+
+typedef struct {
+  u8 state;
+  u8 phase;
+  u64 next;
+  bool clk;
+  bool dat;
+
+  // device -> host frame
+  u16 frame;
+  u8 bits;
+  u64 first;
+  u64 last;
+  u64 end;
+  bool gap;
+
+  // host -> device byte
+  u8 byte;
+  u8 edges;
+  u64 release;
+  u64 done;
+  bool ack;
+
+  u64 inhibit_end;
+  u64 released;
+  bool inhibit;
+
+  // device side queue
+  u8 q[256];
+  u8 head;
+  u8 tail;
+  u64 idle_since;
+} peer_state;
+
+peer_state peers[SIM_PORTS];
+
+u8 parity(u8 byte) {
+  u8 p = 1;
+  for(u8 i = 0; i < 8; i++) p ^= byte >> i & 1;
+  return p;
+}
+
+// host/device for the first port, host1/device1 for the second
+const char* peer_name(u8 port) {
+  static const char* names[2][SIM_PORTS] = { { "device", "device1" }, { "host", "host1" } };
+  return names[peer_is_host][port];
+}
+
+void peer_drive(u8 pin, bool low) {
+  sim_peer_low[pin] = low;
+}
+
+void peer_host_send(u8 port, u8 byte) {
+  peer_state* peer = &peers[port];
+  peer->byte = byte;
+  peer->state = PH_RTS;
+  peer->bits = 0;
+  peer_drive(SIM_CLK(port), 1);
+  peer->next = sim_now + SIM_US(100);
+}
+
+void peer_inhibit(u8 port, u32 us) {
+  peer_state* peer = &peers[port];
+  peer_drive(SIM_CLK(port), 1);
+  peer->bits = 0;
+  peer->inhibit_end = sim_now + SIM_US(us);
+  if(peer->state == PH_IDLE) peer->state = PH_INHIBIT;
+}
+
+void peer_device_send(u8 port, u8 byte) {
+  peers[port].q[peers[port].head++] = byte;
+}
+
+u64 peer_next() {
+  u64 next = UINT64_MAX;
+  for(u8 port = 0; port < sim_ports; port++) {
+    peer_state* peer = &peers[port];
+    if(peer->state != PH_IDLE && peer->next && peer->next < next) next = peer->next;
+    if(peer->inhibit_end && peer->inhibit_end < next) next = peer->inhibit_end;
+  }
+  return next;
+}
+
+// Device to host frames are sampled on the falling clock edge
+void peer_host_falling(u8 port, u64 now) {
+  peer_state* peer = &peers[port];
+  if(peer->state == PH_SEND) {
+    peer->edges++;
+    if(peer->edges == 1) sim_stat_add(port, ST_RTS, SIM_TO_US(now - peer->release));
+    if(peer->edges <= 9) {
+      u16 bits = peer->byte | parity(peer->byte) << 8;
+      peer_drive(SIM_DAT(port), !(bits >> (peer->edges - 1) & 1));
+    } else if(peer->edges == 10) {
+      peer_drive(SIM_DAT(port), 0);
+    } else {
+      peer->ack = !sim_pin(SIM_DAT(port));
+      sim_log("%s > %02x%s", peer_name(port), peer->byte, peer->ack ? "" : "  (no ack)");
+      if(!peer->ack) sim_errors++;
+      if(peer->ack && peer->byte == 0xfe) sim_resend(port);
+      peer->done = now;
+      peer->state = PH_IDLE;
+    }
+    return;
+  }
+
+  if(peer->bits && now - peer->last > SIM_US(2000)) {
+    sim_log("%s: frame timeout after %u bits", peer_name(port), peer->bits);
+    sim_errors++;
+    peer->bits = 0;
+  }
+
+  if(!peer->bits) {
+    if(sim_pin(SIM_DAT(port))) return;
+    peer->first = now;
+    peer->frame = 0;
+    if(peer->gap) sim_stat_add(port, ST_GAP, SIM_TO_US(now - peer->end));
+    if(peer->done) sim_stat_add(port, ST_ACK, SIM_TO_US(now - peer->done));
+    if(peer->inhibit) sim_stat_add(port, ST_INHIBIT, SIM_TO_US(now - peer->released));
+    sim_packet_start(port);
+    peer->gap = false;
+    peer->done = 0;
+    peer->inhibit = false;
+  } else {
+    sim_stat_add(port, ST_BIT, SIM_TO_US(now - peer->last));
+  }
+
+  peer->frame |= sim_pin(SIM_DAT(port)) << peer->bits;
+  peer->last = now;
+  peer->bits++;
+
+  if(peer->bits == 11) {
+    u8 byte = peer->frame >> 1;
+    bool ok = !(peer->frame & 1) && (peer->frame >> 10 & 1) && (peer->frame >> 9 & 1) == parity(byte);
+    sim_log("%s < %02x%s", peer_name(port), byte, ok ? "" : "  (framing/parity error)");
+    if(!ok) sim_errors++;
+    sim_stat_add(port, ST_BYTE, SIM_TO_US(now - peer->first));
+    sim_bytes[port]++;
+    sim_packet_byte(port, byte);
+    if(sim_pending[port]) sim_pending[port]--;
+    peer->gap = sim_pending[port] > 0;
+    peer->end = now;
+    peer->bits = 0;
+
+    // like an 8042, hold the clock low until the byte has been read
+    if(peer_hold_us) {
+      peer->state = PH_INHIBIT;
+      peer->inhibit_end = now + SIM_US(peer_hold_us);
+      peer->next = now + SIM_US(peer_half_us);
+    }
+  }
+}
+
+void peer_host_step(u8 port, u64 now) {
+  peer_state* peer = &peers[port];
+  if(peer->inhibit_end && now >= peer->inhibit_end) {
+    peer_drive(SIM_CLK(port), 0);
+    peer->inhibit_end = 0;
+    peer->released = now;
+    peer->inhibit = sim_pending[port] > 0;
+    if(peer->state == PH_INHIBIT) peer->state = PH_IDLE;
+  }
+
+  if(peer->next && now >= peer->next) {
+    peer->next = 0;
+    switch(peer->state) {
+      case PH_RTS:
+        peer_drive(SIM_DAT(port), 1);
+        peer->state = PH_RTS_DATA;
+        peer->next = now + SIM_US(5);
+      break;
+
+      case PH_RTS_DATA:
+        peer_drive(SIM_CLK(port), 0);
+        peer->state = PH_SEND;
+        peer->release = now;
+        peer->edges = 0;
+      break;
+
+      case PH_INHIBIT:
+        if(peer->inhibit_end) peer_drive(SIM_CLK(port), 1);
+      break;
+    }
+  }
+
+  bool clk = sim_pin(SIM_CLK(port));
+  if(peer->clk && !clk && !sim_peer_low[SIM_CLK(port)]) peer_host_falling(port, now);
+  peer->clk = clk;
+}
+
+// The device generates the clock for both directions
+void peer_device_step(u8 port, u64 now) {
+  peer_state* peer = &peers[port];
+  u64 half = SIM_US(peer_half_us);
+  bool clk = sim_pin(SIM_CLK(port));
+
+  switch(peer->state) {
+    case PD_IDLE:
+      if(!clk || !peer->clk) peer->idle_since = now;
+
+      // request to send: host released the clock while holding data low
+      if(!peer->clk && clk && !sim_pin(SIM_DAT(port))) {
+        peer->state = PD_RX;
+        peer->phase = 0;
+        peer->bits = 0;
+        peer->frame = 0;
+        peer->release = now;
+        peer->next = now + half;
+        break;
+      }
+
+      if(peer->head != peer->tail && clk && now - peer->idle_since >= SIM_US(50)) {
+        u8 byte = peer->q[peer->tail];
+        peer->frame = byte << 1 | parity(byte) << 9 | 1 << 10;
+        peer->state = PD_TX;
+        peer->phase = 0;
+        peer->bits = 0;
+        peer->next = now;
+      }
+    break;
+
+    case PD_TX:
+      if(now < peer->next) break;
+      if(peer->phase != 1 && !clk) {
+        // inhibited by the host before the 11th clock, send it again later
+        sim_log("%s: inhibited at bit %u", peer_name(port), peer->bits);
+        peer_drive(SIM_DAT(port), 0);
+        peer->state = PD_IDLE;
+        peer->idle_since = now;
+        break;
+      }
+      switch(peer->phase) {
+        case 0:
+          peer_drive(SIM_DAT(port), !(peer->frame >> peer->bits & 1));
+          peer->next = now + half / 2;
+          peer->phase = 2;
+        break;
+        case 2:
+          peer_drive(SIM_CLK(port), 1);
+          if(peer->bits) sim_stat_add(port, ST_BIT, SIM_TO_US(now - peer->last));
+          peer->last = now;
+          peer->next = now + half;
+          peer->phase = 1;
+        break;
+        case 1:
+          peer_drive(SIM_CLK(port), 0);
+          peer->bits++;
+          if(peer->bits == 11) {
+            peer_drive(SIM_DAT(port), 0);
+            sim_log("%s > %02x", peer_name(port), peer->q[peer->tail]);
+            sim_bytes[port]++;
+            peer->tail++;
+            peer->state = PD_IDLE;
+            peer->idle_since = now;
+            break;
+          }
+          peer->next = now + half / 2;
+          peer->phase = 0;
+        break;
+      }
+    break;
+
+    case PD_RX:
+      if(now < peer->next) break;
+      switch(peer->phase) {
+        case 0:
+          if(!peer->bits) sim_stat_add(port, ST_RTS, SIM_TO_US(now - peer->release));
+          peer_drive(SIM_CLK(port), 1);
+          peer->next = now + half;
+          peer->phase = 1;
+        break;
+        case 1:
+          peer_drive(SIM_CLK(port), 0);
+          peer->next = now + half / 2;
+          peer->phase = 2;
+        break;
+        case 2:
+          peer->frame |= sim_pin(SIM_DAT(port)) << peer->bits;
+          peer->bits++;
+          peer->next = now + half / 2;
+          peer->phase = peer->bits == 10 ? 3 : 0;
+        break;
+        case 3:
+          peer_drive(SIM_DAT(port), 1);
+          peer_drive(SIM_CLK(port), 1);
+          peer->next = now + half;
+          peer->phase = 4;
+        break;
+        case 4:
+          peer_drive(SIM_CLK(port), 0);
+          peer->next = now + half / 2;
+          peer->phase = 5;
+        break;
+        case 5: {
+          peer_drive(SIM_DAT(port), 0);
+          u8 byte = peer->frame;
+          bool ok = (peer->frame >> 8 & 1) == parity(byte) && (peer->frame >> 9 & 1);
+          sim_log("%s < %02x%s", peer_name(port), byte, ok ? "" : "  (framing/parity error)");
+          if(!ok) sim_errors++;
+          for(u8 i = 1; i <= sim_reply[byte][0]; i++) peer_device_send(port, sim_reply[byte][i]);
+          peer->state = PD_IDLE;
+          peer->idle_since = now;
+        } break;
+      }
+    break;
+  }
+
+  peer->clk = clk;
+}
+
+void peer_step(u64 now) {
+  for(u8 port = 0; port < sim_ports; port++) {
+    if(peer_is_host) {
+      peer_host_step(port, now);
+    } else {
+      peer_device_step(port, now);
+    }
+  }
+}
@@ -0,0 +1,54 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 No0ne (https://github.com/No0ne)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "ps2x2pico.h"
+
+// Renders trace records back into the firmware's original log messages
+
+#define TRACE_FORMAT(event, level, format) format,
+const char* const trace_formats[TR_COUNT] = { TRACE_EVENTS(TRACE_FORMAT) };
+
+void trace_format(char* buf, u16 size, u8 event, const u8* args, u8 len) {
+  if(event >= TR_COUNT) {
+    snprintf(buf, size, "unknown trace event %u", event);
+    return;
+  }
+
+  const char* format = trace_formats[event];
+
+  if(strstr(format, "%s")) {
+    char list[256 * 3 + 1] = "";
+    for(u16 i = 0; i < len; i++) {
+      sprintf(list + i * 3, " %02x", args[i]);
+    }
+    snprintf(buf, size, format, list);
+    return;
+  }
+
+  unsigned a[4] = { 0 };
+  for(u8 i = 0; i < len && i < 4; i++) {
+    a[i] = args[i];
+  }
+  snprintf(buf, size, format, a[0], a[1], a[2], a[3]);
+}
@@ -0,0 +1,74 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 No0ne (https://github.com/No0ne)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "ps2x2pico.h"
+
+// tracedec - decodes the firmware's UART output back into log messages
+//
+// usage: tracedec [-t] [capture]
+//
+// Reads a raw UART capture from the file or stdin, e.g. cat /dev/ttyACM0 | tracedec -t
+// Plain printf text is passed through, trace records are written as one line each,
+// -t prefixes them with their timestamp in seconds.
+//
+// Record layout: 0x80|event, length, u32 time in us (little endian), length argument bytes.
+// Text output is 7-bit ASCII, so a set high bit always starts a record.
+
+int main(int argc, char** argv) {
+  bool timestamps = false;
+  FILE* in = stdin;
+
+  for(int i = 1; i < argc; i++) {
+    if(!strcmp(argv[i], "-t")) {
+      timestamps = true;
+    } else if(!(in = fopen(argv[i], "rb"))) {
+      perror(argv[i]);
+      return 1;
+    }
+  }
+
+  int c;
+  while((c = getc(in)) != EOF) {
+    if(!(c & 0x80)) {
+      putchar(c);
+      continue;
+    }
+
+    u8 head[5];
+    u8 args[255];
+    if(fread(head, 1, 5, in) != 5 || fread(args, 1, head[0], in) != head[0]) break;
+
+    char line[1024];
+    trace_format(line, sizeof(line), c & 0x7f, args, head[0]);
+
+    if(timestamps) {
+      u32 time = head[1] | head[2] << 8 | head[3] << 16 | (u32)head[4] << 24;
+      printf("[%4u.%06u] ", time / 1000000, time % 1000000);
+    }
+    printf("%s\n", line);
+    fflush(stdout);
+  }
+
+  return 0;
+}
@@ -0,0 +1,528 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 No0ne (https://github.com/No0ne)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "hal_pico.h"
+#include "tusb.h"
+#include "bsp/board_api.h"
+#include "pico/stdio.h"
+#include "pico/util/queue.h"
+#include "hardware/uart.h"
+#include "hardware/sync.h"
+
+// USB runs on core0, the PS/2 side including its alarms on core1.
+// Key and mouse events go to core1 through hal_kb_events and hal_ms_events, LED changes
+// come back through hal_leds. core0 never waits for core1: key changes that do not fit
+// are replaced by a snapshot of the held keys, movement is added up until it fits.
+#define EV_KEY 0
+#define EV_MOVEMENT 1
+#define EV_KB_SYNC 2
+
+typedef struct {
+  u8 type;
+  u8 key;
+  bool is_key_pressed;
+  u8 modifiers;
+  s16 x;
+  s16 y;
+  s8 z;
+  u32 time;
+} hal_event;
+
+ps2out kb_out;
+ps2out ms_out;
+ps2in kb_in;
+ps2in ms_in;
+
+// Trace records, one byte ring per core so both can record without locking each other out.
+// Record: 0x80|event, length, u32 time in us (little endian), length argument bytes.
+// host/tracedec.c turns the UART output back into text.
+#define TRACE_RING 1024
+#define TRACE_HEAD 6
+
+typedef struct {
+  u8 buf[TRACE_RING];
+  volatile u16 head;
+  volatile u16 tail;
+  u8 dropped;
+  u32 dropped_total;
+} hal_trace_ring;
+
+hal_trace_ring hal_traces[2];
+
+queue_t hal_kb_events;
+queue_t hal_kb_sync;
+queue_t hal_ms_events;
+queue_t hal_leds;
+alarm_pool_t* hal_alarms;
+alarm_id_t hal_alarm = 0;
+volatile bool hal_alarm_lost = false; // no alarm could be added, core1's loop runs the jobs
+u32 hal_alarm_failures = 0;
+
+// arrival of the USB report being handled, and of the oldest input per port not sent yet
+u32 hal_report_time = 0;
+u32 hal_origin[2] = { 0, 0 };
+
+bool hal_kb_lost = false;
+u32 hal_kb_lost_events = 0;
+
+// Mouse reports waiting for room in hal_ms_events, added up while the buttons stay the same
+#define HAL_MS_PENDING 8
+typedef struct {
+  u8 buttons;
+  s32 dx;
+  s32 dy;
+  s32 dz;
+  u32 time;
+} hal_ms_report;
+
+hal_ms_report hal_ms_reports[HAL_MS_PENDING];
+u8 hal_ms_head = 0;
+u8 hal_ms_count = 0;
+u32 hal_ms_merged = 0;
+u32 hal_ms_clicks_lost = 0;
+
+// worst case PS/2 service latency, since the last print
+u32 hal_loop_max = 0;
+u32 hal_event_max = 0;
+u32 hal_loop_last = 0;
+
+void hal_init() {
+  queue_init(&hal_kb_events, sizeof(hal_event), 64);
+  queue_init(&hal_kb_sync, sizeof(u32) * 8, 1);
+  queue_init(&hal_ms_events, sizeof(hal_event), 64);
+  queue_init(&hal_leds, sizeof(u8), 4);
+}
+
+// Writes whole records, oldest first, only into an empty UART FIFO so this loop never
+// waits and text never ends up inside a record. printf itself still blocks once the
+// FIFO is full, so long text is only printed on request.
+void hal_trace_drain() {
+  uart_hw_t* uart = uart_get_hw(uart_default);
+  if(!(uart->fr & UART_UARTFR_TXFE_BITS)) return;
+
+  u8 room = 32;
+  while(1) {
+    hal_trace_ring* next = NULL;
+    u32 next_time = 0;
+
+    for(u8 core = 0; core < 2; core++) {
+      hal_trace_ring* r = &hal_traces[core];
+      if(r->head == r->tail) continue;
+
+      u32 time = 0;
+      for(u8 i = 0; i < 4; i++) time |= r->buf[(r->tail + 2 + i) % TRACE_RING] << (i * 8);
+      if(!next || (s32)(time - next_time) < 0) {
+        next = r;
+        next_time = time;
+      }
+    }
+    if(!next) return;
+
+    u16 tail = next->tail;
+    u16 len = TRACE_HEAD + next->buf[(tail + 1) % TRACE_RING];
+    if(len > room) return;
+    room -= len;
+
+    while(len--) {
+      uart->dr = next->buf[tail];
+      tail = (tail + 1) % TRACE_RING;
+    }
+    __dmb();
+    next->tail = tail;
+  }
+}
+
+void hal_core0_task() {
+  u8 leds;
+  while(queue_try_remove(&hal_leds, &leds)) {
+    tuh_kb_set_leds(leds);
+  }
+  
+  hal_kb_flush();
+  hal_ms_flush();
+  
+  // s prints the statistics, c clears the latency histograms. The print blocks
+  // core0 for tens of ms, the PS/2 side on core1 goes on.
+  int c = getchar_timeout_us(0);
+  if(c == 's') hal_print_stats();
+  if(c == 'c') hal_clear_stats();
+  
+  hal_trace_drain();
+}
+
+void hal_core1_init() {
+  // alarm callbacks fire on the core that created the pool. It only ever holds the
+  // scheduler's alarm, and its replacement while the old one is being handled.
+  hal_alarms = alarm_pool_create(2, 2);
+  hal_loop_last = time_us_32();
+}
+
+void hal_core1_task() {
+  // sched_run() runs what is due and tries to arm the alarm again
+  if(hal_alarm_lost) {
+    hal_alarm_lost = false;
+    sched_run();
+  }
+
+  hal_event event;
+  while(queue_try_remove(&hal_ms_events, &event)) {
+    u32 latency = time_us_32() - event.time;
+    if(latency > hal_event_max) hal_event_max = latency;
+    hal_ps2_input(PS2_MS, event.time);
+    ms_send_movement(MS_USB, event.key, event.x, event.y, event.z);
+  }
+
+  // key changes wait in the queue until their sequence fits into the PS/2 queue
+  while(kb_ready() && queue_try_remove(&hal_kb_events, &event)) {
+    u32 latency = time_us_32() - event.time;
+    if(latency > hal_event_max) hal_event_max = latency;
+
+    if(event.type == EV_KB_SYNC) {
+      u32 keys[8];
+      queue_remove_blocking(&hal_kb_sync, keys);
+      kb_sync(keys);
+      continue;
+    }
+
+    hal_origin[PS2_KB] = event.time;
+    kb_send_key(event.key, event.is_key_pressed, event.modifiers);
+    hal_origin[PS2_KB] = 0;
+  }
+
+  u32 now = time_us_32();
+  if(now - hal_loop_last > hal_loop_max) hal_loop_max = now - hal_loop_last;
+  hal_loop_last = now;
+}
+
+void hal_print_hist(const char* name, ps2out_hist* hist) {
+  printf("  %-6s", name);
+  for(u8 i = 0; i < PS2OUT_HIST; i++) printf(" %5u", (uint)hist->count[i]);
+  printf("  max %u\n", (uint)hist->max);
+}
+
+void hal_print_stats() {
+  printf(" PS/2 service latency: loop max %u us, event max %u us\n", (uint)hal_loop_max, (uint)hal_event_max);
+  printf(" PS/2 queues: kb %u/%u max %u dropped %u restarted %u, ms %u/%u max %u dropped %u restarted %u\n",
+    ps2out_level(&kb_out), PS2OUT_BYTES, kb_out.max_level, (uint)kb_out.dropped, (uint)kb_out.restarts,
+    ps2out_level(&ms_out), PS2OUT_BYTES, ms_out.max_level, (uint)ms_out.dropped, (uint)ms_out.restarts);
+  printf(" PS/2 retries: kb %u in %u packets max %u, ms %u in %u packets max %u\n",
+    (uint)kb_out.retries, (uint)kb_out.retried, kb_out.retry_max, (uint)ms_out.retries, (uint)ms_out.retried, ms_out.retry_max);
+  printf(" Overflows: key events %u, kb sequences %u, kb resyncs %u, mouse reports merged %u, button changes lost %u\n",
+    (uint)hal_kb_lost_events, (uint)kb_overflows, (uint)kb_resyncs, (uint)hal_ms_merged, (uint)(hal_ms_clicks_lost + ms_clicks_lost));
+  ps2out* outs[2] = { &kb_out, &ms_out };
+  for(u8 port = 0; port < 2; port++) {
+    printf(" %s latency us, counts below 8 << n and above:\n", port ? "ms" : "kb");
+    #ifdef MS_LOW_LATENCY
+      if(port) printf("  (packets as fast as the bus allows)\n");
+    #else
+      if(port) printf("  (packets at the host's sample rate)\n");
+    #endif
+    hal_print_hist("ack", &outs[port]->ack);
+    hal_print_hist("input", &outs[port]->input);
+    hal_print_hist("queue", &outs[port]->queue);
+    hal_print_hist("bus", &outs[port]->bus);
+    printf("  reply to command count/avg/max us:");
+    for(u8 i = 0; i < PS2OUT_CMDS && outs[port]->cmds[i].count; i++) {
+      ps2out_cmd* cmd = &outs[port]->cmds[i];
+      printf(" %02x %u/%u/%u", cmd->cmd, (uint)cmd->count, (uint)(cmd->sum / cmd->count), (uint)cmd->max);
+    }
+    printf("\n");
+  }
+  printf(" Scheduler late max/avg us:");
+  for(u8 i = 0; i < JOB_COUNT; i++) {
+    sched_job* j = &sched_jobs[i];
+    printf(" %s %u/%u", sched_names[i], (uint)j->late_max, j->runs ? (uint)(j->late_sum / j->runs) : 0);
+  }
+  printf(", alarm failures %u\n", (uint)hal_alarm_failures);
+  printf(" Trace records dropped: core0 %u, core1 %u\n", (uint)hal_traces[0].dropped_total, (uint)hal_traces[1].dropped_total);
+  hal_loop_max = 0;
+  hal_event_max = 0;
+}
+
+// The histograms are written by core1, a print may mix old and new counts
+void hal_clear_stats() {
+  ps2out* outs[2] = { &kb_out, &ms_out };
+  for(u8 port = 0; port < 2; port++) {
+    memset(&outs[port]->ack, 0, sizeof(ps2out_hist));
+    memset(&outs[port]->input, 0, sizeof(ps2out_hist));
+    memset(&outs[port]->queue, 0, sizeof(ps2out_hist));
+    memset(&outs[port]->bus, 0, sizeof(ps2out_hist));
+    memset(outs[port]->cmds, 0, sizeof(outs[port]->cmds));
+  }
+  for(u8 i = 0; i < JOB_COUNT; i++) {
+    sched_jobs[i].runs = 0;
+    sched_jobs[i].late_max = 0;
+    sched_jobs[i].late_sum = 0;
+  }
+  printf(" PS/2 latency histograms cleared\n");
+}
+
+// After key changes were dropped the held keys follow as one snapshot, in order with the events.
+// core0 is the only producer, so both queues still have room once checked.
+void hal_kb_flush() {
+  if(!hal_kb_lost || queue_is_full(&hal_kb_events) || !queue_is_empty(&hal_kb_sync)) return;
+
+  u32 keys[8];
+  usbin_kb_state(keys);
+  queue_try_add(&hal_kb_sync, keys);
+
+  hal_event event = { EV_KB_SYNC, 0, false, 0, 0, 0, 0, time_us_32() };
+  queue_try_add(&hal_kb_events, &event);
+  hal_kb_lost = false;
+}
+
+void hal_kb_key(u8 key, bool is_key_pressed, u8 modifiers) {
+  hal_kb_flush();
+  hal_event event = { EV_KEY, key, is_key_pressed, modifiers, 0, 0, 0, hal_report_time };
+  if(hal_kb_lost || !queue_try_add(&hal_kb_events, &event)) {
+    hal_kb_lost = true;
+    hal_kb_lost_events++;
+  }
+}
+
+s32 hal_ms_clamp(s64 v, s32 max) {
+  return v < -max - 1 ? -max - 1 : v > max ? max : v;
+}
+
+// Queues the reports waiting, oldest first, in steps that fit an event. False if the queue is full.
+bool hal_ms_flush() {
+  while(hal_ms_count) {
+    hal_ms_report* report = &hal_ms_reports[hal_ms_head];
+    s16 x = hal_ms_clamp(report->dx, INT16_MAX);
+    s16 y = hal_ms_clamp(report->dy, INT16_MAX);
+    s8 z = hal_ms_clamp(report->dz, INT8_MAX);
+    hal_event event = { EV_MOVEMENT, report->buttons, false, 0, x, y, z, report->time };
+    if(!queue_try_add(&hal_ms_events, &event)) return false;
+
+    report->dx -= x;
+    report->dy -= y;
+    report->dz -= z;
+    if(!report->dx && !report->dy && !report->dz) {
+      hal_ms_head = (hal_ms_head + 1) % HAL_MS_PENDING;
+      hal_ms_count--;
+    }
+  }
+  return true;
+}
+
+// A button change starts a report of its own, so no click is merged away.
+// With all of them in use the newest takes the change, and a press and release pair is lost.
+void hal_ms_movement(u8 buttons, s32 x, s32 y, s8 z) {
+  hal_ms_report* report = &hal_ms_reports[(hal_ms_head + hal_ms_count + HAL_MS_PENDING - 1) % HAL_MS_PENDING];
+  if(!hal_ms_count || (report->buttons != buttons && hal_ms_count < HAL_MS_PENDING)) {
+    report = &hal_ms_reports[(hal_ms_head + hal_ms_count) % HAL_MS_PENDING];
+    hal_ms_count++;
+    *report = (hal_ms_report){ buttons, 0, 0, 0, hal_report_time };
+  } else if(report->buttons != buttons) {
+    hal_ms_clicks_lost++;
+  }
+
+  report->buttons = buttons;
+  report->dx = hal_ms_clamp((s64)report->dx + x, INT32_MAX);
+  report->dy = hal_ms_clamp((s64)report->dy + y, INT32_MAX);
+  report->dz = hal_ms_clamp((s64)report->dz + z, INT32_MAX);
+  if(!hal_ms_flush()) hal_ms_merged++;
+}
+
+void hal_kb_leds(u8 leds) {
+  queue_try_add(&hal_leds, &leds);
+}
+
+void hal_trace_put(hal_trace_ring* r, u16* head, u8 event, u32 time, const u8* args, u8 len) {
+  r->buf[*head] = 0x80 | event;
+  r->buf[(*head + 1) % TRACE_RING] = len;
+  for(u8 i = 0; i < 4; i++) r->buf[(*head + 2 + i) % TRACE_RING] = time >> (i * 8);
+  *head = (*head + TRACE_HEAD) % TRACE_RING;
+
+  for(u8 i = 0; i < len; i++) {
+    r->buf[*head] = args[i];
+    *head = (*head + 1) % TRACE_RING;
+  }
+}
+
+// called from both cores and from the PS/2 receive IRQ, never blocks
+void hal_trace(u8 event, const u8* args, u8 len) {
+  hal_trace_ring* r = &hal_traces[get_core_num()];
+  u32 irq = save_and_disable_interrupts();
+
+  u16 head = r->head;
+  u16 used = (head - r->tail + TRACE_RING) % TRACE_RING;
+  u16 need = TRACE_HEAD + len + (r->dropped ? TRACE_HEAD + 1 : 0);
+
+  if(TRACE_RING - 1 - used < need) {
+    if(r->dropped < 0xff) r->dropped++;
+    r->dropped_total++;
+    restore_interrupts(irq);
+    return;
+  }
+
+  u32 time = time_us_32();
+  if(r->dropped) {
+    hal_trace_put(r, &head, TR_DROPPED, time, &r->dropped, 1);
+    r->dropped = 0;
+  }
+  hal_trace_put(r, &head, event, time, args, len);
+
+  __dmb();
+  r->head = head;
+  restore_interrupts(irq);
+}
+
+ps2out* hal_out(u8 port) {
+  return port == PS2_KB ? &kb_out : &ms_out;
+}
+
+// returns NULL if the port has no PS/2 passthru input
+ps2in* hal_in(u8 port) {
+  #ifdef KBIN
+    if(port == PS2_KB) return &kb_in;
+  #endif
+  #ifdef MSIN
+    if(port == PS2_MS) return &ms_in;
+  #endif
+  return NULL;
+}
+
+void hal_ps2_init(u8 port, u8 gpio_out, u8 gpio_in, rx_callback rx) {
+  ps2out_init(hal_out(port), pio1, gpio_out, rx);
+  hal_out(port)->gap_us = port == PS2_KB ? KB_GAP_US : MS_GAP_US;
+  if(hal_in(port)) ps2in_init(hal_in(port), pio0, gpio_in);
+}
+
+// Marks input for the port, the next packet measures its latency from the oldest one
+void hal_ps2_input(u8 port, u32 time) {
+  if(!hal_origin[port]) hal_origin[port] = time;
+}
+
+// only replies to host commands are sent byte by byte, they skip the queued packets
+void hal_ps2_send(u8 port, u8 byte) {
+  ps2out_reply(hal_out(port), byte);
+}
+
+bool hal_ps2_send_packet(u8 port, const u8* bytes, u8 len) {
+  if(!ps2out_send(hal_out(port), bytes, len, hal_origin[port])) return false;
+  hal_origin[port] = 0;
+  return true;
+}
+
+u16 hal_ps2_room(u8 port) {
+  return ps2out_room(hal_out(port));
+}
+
+void hal_ps2_expect(u8 port) {
+  ps2out_expect(hal_out(port));
+}
+
+void hal_ps2_clear(u8 port) {
+  ps2out_clear(hal_out(port));
+}
+
+// a byte on the wire or anything still queued for it
+bool hal_ps2_busy(u8 port) {
+  ps2out* out = hal_out(port);
+  return out->busy || ps2out_level(out) || out->reply_tail != out->reply_head;
+}
+
+void hal_ps2_task(u8 port) {
+  ps2out_task(hal_out(port));
+  if(hal_in(port)) ps2in_task(hal_in(port), hal_out(port));
+}
+
+void hal_ps2in_reset(u8 port) {
+  if(hal_in(port)) ps2in_reset(hal_in(port));
+}
+
+void hal_ps2in_set(u8 port, u8 command, u8 byte) {
+  if(hal_in(port)) ps2in_set(hal_in(port), command, byte);
+}
+
+s64 hal_alarm_fire(alarm_id_t id, void* data) {
+  (void)data;
+  if(id == hal_alarm) hal_alarm = 0;
+  sched_run();
+  return 0;
+}
+
+void hal_alarm_at(u64 us) {
+  if(hal_alarm) alarm_pool_cancel_alarm(hal_alarms, hal_alarm);
+
+  // 0 means the time has passed already, fire as soon as possible instead
+  alarm_id_t id;
+  while(!(id = alarm_pool_add_alarm_at(hal_alarms, from_us_since_boot(us), hal_alarm_fire, NULL, false))) {
+    us = time_us_64() + 10;
+  }
+  hal_alarm = id > 0 ? id : 0;
+  if(id < 0) {
+    hal_alarm_failures++;
+    hal_alarm_lost = true;
+  }
+}
+
+u32 hal_lock() {
+  return save_and_disable_interrupts();
+}
+
+void hal_unlock(u32 state) {
+  restore_interrupts(state);
+}
+
+u64 hal_time_us() {
+  return time_us_64();
+}
+
+bool hal_hid_receive_report(u8 dev_addr, u8 instance) {
+  return tuh_hid_receive_report(dev_addr, instance);
+}
+
+void hal_hid_set_leds(u8 dev_addr, u8 instance, u8* leds) {
+  tuh_hid_set_report(dev_addr, instance, 0, HID_REPORT_TYPE_OUTPUT, leds, sizeof(*leds));
+}
+
+void hal_led(bool on) {
+  board_led_write(on);
+}
+
+void tuh_hid_mount_cb(u8 dev_addr, u8 instance, u8 const* desc_report, u16 desc_len) {
+  // This happens if report descriptor length > CFG_TUH_ENUMERATION_BUFSIZE.
+  // Consider increasing #define CFG_TUH_ENUMERATION_BUFSIZE 256 in tusb_config.h
+  if(desc_report == NULL && desc_len == 0) {
+    printf("WARNING: HID(%d,%d) skipped!\n", dev_addr, instance);
+    return;
+  }
+
+  u16 vid, pid;
+  tuh_vid_pid_get(dev_addr, &vid, &pid);
+  usbin_mount(dev_addr, instance, tuh_hid_interface_protocol(dev_addr, instance), tuh_hid_get_protocol(dev_addr, instance), vid, pid, desc_report, desc_len);
+}
+
+void tuh_hid_umount_cb(u8 dev_addr, u8 instance) {
+  hal_report_time = time_us_32();
+  usbin_umount(dev_addr, instance);
+}
+
+void tuh_hid_report_received_cb(u8 dev_addr, u8 instance, u8 const* report, u16 len) {
+  hal_report_time = time_us_32();
+  usbin_report(dev_addr, instance, report, len);
+  tuh_hid_receive_report(dev_addr, instance);
+}
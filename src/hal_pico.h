@@ -0,0 +1,159 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 No0ne (https://github.com/No0ne)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "ps2x2pico.h"
+#include "hardware/pio.h"
+
+// Firmware-only part of the HAL, the ports are driven by PIO state machines.
+// The conversion core (ps2x2core) never includes this so it builds without the SDK.
+
+void hal_init();
+void hal_core0_task();
+void hal_kb_flush();
+bool hal_ms_flush();
+void hal_core1_init();
+void hal_core1_task();
+void hal_ps2_input(u8 port, u32 time);
+void hal_print_stats();
+void hal_clear_stats();
+
+u32 ps2_frame(u8 byte);
+
+// Lock-free single producer/single consumer rings, head is only written by
+// the producer and tail by the consumer. Both are free running and wrap at 256.
+#define PS2OUT_BYTES 128
+#define PS2OUT_PACKS 32
+
+// Replies to host commands wait in their own ring and go out ahead of queued packets
+#define PS2OUT_REPLIES 16
+
+// After a host command that takes an argument, queued packets wait at most this long for it
+#define PS2OUT_ARG_US 20000
+
+// Commands with their own reply time stats, per port
+#define PS2OUT_CMDS 16
+
+// Default idle time between two bytes, measured from the end of the previous one
+#define PS2OUT_GAP_US 800
+
+// Latency histograms, bucket n counts samples below 8 << n µs, the last one everything above
+#define PS2OUT_HIST 14
+
+// With PS2OUT_DMA a packet is streamed into the PIO in chunks of up to this many frames
+#define PS2OUT_FRAMES 16
+
+typedef struct {
+  u32 count[PS2OUT_HIST];
+  u32 max;
+} ps2out_hist;
+
+typedef struct {
+  u8 start;
+  u8 len;
+  u8 retries;
+  u32 queued;
+  u32 origin;
+} ps2out_pack;
+
+typedef struct {
+  u8 cmd;
+  u32 count;
+  u32 max;
+  u32 sum;
+} ps2out_cmd;
+
+typedef struct {
+  PIO pio;
+  uint sm;
+  u8 bytes[PS2OUT_BYTES];
+  ps2out_pack packs[PS2OUT_PACKS];
+  volatile u8 byte_head;
+  volatile u8 byte_tail;
+  volatile u8 pack_head;
+  volatile u8 pack_tail;
+  u8 replies[PS2OUT_REPLIES];
+  volatile u8 reply_head;
+  volatile u8 reply_tail;
+  bool replying;
+  bool hold;
+  bool arg_pending;
+  u64 arg_until;
+  u8 max_level;
+  u32 dropped;
+  u32 restarts;
+  u32 retries;  // bytes sent again after an inhibit or a resend command
+  u32 retried;  // packets with at least one of them
+  u8 retry_max; // most in one packet
+  rx_callback rx;
+  u8 last_rx;
+  u8 last_tx; // last byte the host got in full, for its resend command
+  u8 prev_tx;
+  u8 sent;
+  u8 busy;
+  u16 gap_us;
+  u64 ready;
+  bool ack_pending;
+  u8 rx_cmd;
+  u32 rx_time;
+  bool tx_pending;
+  u32 tx_time;
+  ps2out_hist ack;   // host byte until its first reply byte is on the wire
+  ps2out_hist input; // USB report or passthrough byte to the start of the packet
+  ps2out_hist queue; // ps2out_send() to the start of the packet
+  ps2out_hist bus;   // start of the packet until the PIO is done with its last byte
+  ps2out_cmd cmds[PS2OUT_CMDS]; // same as ack, per command
+  #ifdef PS2OUT_DMA
+    int dma;
+    u8 dma_count;
+    u32 frames[PS2OUT_FRAMES];
+  #endif
+} ps2out;
+
+void ps2out_init(ps2out* this, PIO pio, u8 data_pin, rx_callback rx);
+bool ps2out_send(ps2out* this, const u8* bytes, u8 len, u32 origin);
+bool ps2out_reply(ps2out* this, u8 byte);
+void ps2out_expect(ps2out* this);
+void ps2out_clear(ps2out* this);
+u8 ps2out_level(ps2out* this);
+u8 ps2out_room(ps2out* this);
+void ps2out_hist_add(ps2out_hist* hist, u32 us);
+void ps2out_task(ps2out* this);
+
+
+typedef struct {
+  PIO pio;
+  uint sm;
+  u8 state;
+  u8 byte;
+  u8 seq[8]; // keyboard bytes up to the end of a key's sequence
+  u8 seq_len;
+  u8 seq_codes; // code bytes still expected after E1
+  bool seq_ready;
+  u32 seq_time;
+} ps2in;
+
+void ps2in_init(ps2in* this, PIO pio, u8 data_pin);
+void ps2in_task(ps2in* this, ps2out* out);
+void ps2in_reset(ps2in* this);
+void ps2in_set(ps2in* this, u8 command, u8 byte);
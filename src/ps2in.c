@@ -22,8 +22,9 @@
  * THE SOFTWARE.
  *
  */
-#include "ps2x2pico.h"
+#include "hal_pico.h"
 #include "ps2in.pio.h"
+#include "hardware/timer.h"
 
 s8 ps2in_prog = -1;
 u8 ps2in_msi = 0;
@@ -38,9 +39,45 @@ void ps2in_init(ps2in* this, PIO pio, u8 data_pin) {
   ps2in_program_init(pio, this->sm, ps2in_prog, data_pin);
   this->pio = pio;
   this->state = 0;
+  this->seq_len = 0;
+  this->seq_codes = 0;
+  this->seq_ready = false;
+}
+
+// Queues a whole key sequence as one packet, false while there is no room for it
+bool ps2in_flush(ps2in* this, ps2out* out) {
+  if(!this->seq_ready) return true;
+  if(ps2out_room(out) < this->seq_len) return false;
+  ps2out_send(out, this->seq, this->seq_len, this->seq_time);
+  this->seq_len = 0;
+  this->seq_ready = false;
+  return true;
+}
+
+// Adds a keyboard byte, the sequence is complete with a code byte that is not a prefix.
+// E1 (Pause) is followed by two code bytes.
+void ps2in_kb_byte(ps2in* this, u8 byte) {
+  if(!this->seq_len) this->seq_time = time_us_32();
+  this->seq[this->seq_len++] = byte;
+
+  bool prefix = byte == 0xe0 || byte == 0xf0 || byte == 0xe1;
+  if(byte == 0xe1) this->seq_codes = 2;
+  else if(!prefix && this->seq_codes) this->seq_codes--;
+
+  this->seq_ready = (!prefix && !this->seq_codes) || this->seq_len == sizeof(this->seq);
+}
+
+// 9-bit movement from the sign bit in byte 0, an overflowed axis counts as its largest value
+s16 ps2in_xy(u8 flags, u8 byte, u8 sign, u8 overflow) {
+  if(flags & overflow) return flags & sign ? -256 : 255;
+  return flags & sign ? byte - 256 : byte;
 }
 
 void ps2in_task(ps2in* this, ps2out* out) {
+  // While a sequence waits the RX FIFO fills up, and the state machine
+  // then holds the keyboard's clock low until there is room
+  if(!ps2in_flush(this, out)) return;
+
   if(!pio_sm_is_rx_fifo_empty(this->pio, this->sm)) {
     u32 fifo = pio_sm_get(this->pio, this->sm) >> 23;
     
@@ -64,6 +101,8 @@ void ps2in_task(ps2in* this, ps2out* out) {
     
     if(byte == 0xaa && this->state) {
       this->state = this->sm ? 2 : 10;
+      this->seq_len = 0;
+      this->seq_codes = 0;
       //printf("** ps2in  sm %02x  reset successful!\n", this->sm);
     }
     
@@ -74,7 +113,8 @@ void ps2in_task(ps2in* this, ps2out* out) {
       }
       
       if(byte != 0xfa && this->state == 10) {
-        queue_try_add(&out->qbytes, &byte);
+        ps2in_kb_byte(this, byte);
+        ps2in_flush(this, out);
       }
     }
     
@@ -92,7 +132,8 @@ void ps2in_task(ps2in* this, ps2out* out) {
         
         if(ps2in_msi == 4) {
           ps2in_msi = 0;
-          ms_send_movement(ps2in_msb[0] & 0x7, ps2in_msb[1], 0x100 - ps2in_msb[2], 0x100 - ps2in_msb[3]);
+          hal_ps2_input(PS2_MS, time_us_32());
+          ms_send_movement(MS_PS2IN, ps2in_msb[0] & 0x7, ps2in_xy(ps2in_msb[0], ps2in_msb[1], 0x10, 0x40), -ps2in_xy(ps2in_msb[0], ps2in_msb[2], 0x20, 0x80), 0x100 - ps2in_msb[3]);
         }
         
       } else {
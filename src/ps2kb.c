@@ -25,9 +25,6 @@
  */
 #include "ps2x2pico.h"
 
-ps2out kb_out;
-ps2in kb_in;
-
 #define KBHOSTCMD_RESET_FF 0xff
 #define KBHOSTCMD_RESEND_FE 0xfe
 #define KBHOSTCMD_SCS3_SET_KEY_MAKE_FD 0xfd
@@ -86,6 +83,21 @@ u8 scancodeset = SCAN_CODE_SET_2;
 
 u8 scs3keymodemap[HOST_CMD_MIN];
 
+// One entry per HID key up to HID2PS2_IDX_MAX, followed by the 8 modifier keys
+#define KB_SEQS (HID2PS2_IDX_MAX + 1 + 8)
+#define KB_SEQ_IDX(key) (IS_MOD_KEY(key) ? HID2PS2_IDX_MAX + 1 + (key) - HID_KEY_CONTROL_LEFT : (key))
+#define KB_SEQ_MAX 8 // pause in set 2
+
+typedef struct {
+  u8 len;
+  bool typematic;
+  u8 code[KB_SEQ_MAX];
+} kb_seq;
+
+kb_seq kb_make[KB_SEQS];
+kb_seq kb_break[KB_SEQS];
+kb_seq kb_ctrl_pause;
+
 u8 const led2ps2[] = { 0, 4, 1, 5, 2, 6, 3, 7 };
 
 u32 const repeats[] = {
@@ -102,48 +114,45 @@ u8 key2repeat = 0;
 u8 last_byte_sent = 0;
 u32 repeat_us;
 u16 delay_ms;
-alarm_id_t repeater;
+
+// What the USB side holds down and what the host was told. They only differ
+// after a sequence did not fit into the PS/2 queue, kb_task then sends the
+// net difference instead of the changes that were lost.
+u32 kb_want[8];
+u32 kb_host[8];
+bool kb_resync = false;
+u32 kb_overflows = 0;
+u32 kb_resyncs = 0;
 
 void kb_send(u8 byte) {
   if(byte != KB_MSG_RESEND_FE) last_byte_sent = byte;
-  printf("kb > host %02x\n", byte);
-  queue_try_add(&kb_out.qbytes, &byte);
+  trace(TR_KB_TX, byte);
+  hal_ps2_send(PS2_KB, byte);
 }
 
-void kb_resend_last() {
-  printf("r: k>h %x\n", last_byte_sent);
-  queue_try_add(&kb_out.qbytes, &last_byte_sent);
+// sends a whole make or break sequence as one packet, false if it did not fit
+bool kb_send_seq(const kb_seq* seq) {
+  if(!seq->len) return true;
+  if(!hal_ps2_send_packet(PS2_KB, seq->code, seq->len)) return false;
+  last_byte_sent = seq->code[seq->len - 1];
+  trace_bytes(TR_KB_TX_SEQ, seq->code, seq->len);
+  return true;
 }
 
-void kb_maybe_send_prefix(u8 key) {
-  u8 const *l = IS_MOD_KEY(key) ? ext_code_modifier_keys_1_2 : ext_code_keys_1_2;
-  for(int i = 0; l[i]; i++) {
-    if(key == l[i]) {
-      kb_send(KB_EXT_PFX_E0);
-      break;
-    }
-  }
-}
-
-// sends out scan codes from a null byte terminated list
-void kb_send_sc_list(const u8 *list) {
-  key2repeat = 0;
-  for(int i = 0; list[i]; i++) {
-    kb_send(list[i]);
-  }
+void kb_resend_last() {
+  trace(TR_KB_RESEND, last_byte_sent);
+  hal_ps2_send(PS2_KB, last_byte_sent);
 }
 
 void kb_set_leds(u8 byte) {
   if(byte > 7) byte = 0;
-  tuh_kb_set_leds(led2ps2[byte]);
-  #ifdef KBIN
-    ps2in_set(&kb_in, 0xed, byte);
-  #endif
+  hal_kb_leds(led2ps2[byte]);
+  hal_ps2in_set(PS2_KB, 0xed, byte);
 }
 
 s64 blink_callback() {
   if(blinking) {
-    printf("Blinking keyboard LEDs\n");
+    trace0(TR_KB_BLINK);
     kb_set_leds(KEYBOARD_LED_NUMLOCK | KEYBOARD_LED_CAPSLOCK | KEYBOARD_LED_SCROLLLOCK);
     blinking = false;
     return 500000;
@@ -152,13 +161,85 @@ s64 blink_callback() {
   return 0;
 }
 
+bool kb_is_ext(u8 key) {
+  u8 const *l = IS_MOD_KEY(key) ? ext_code_modifier_keys_1_2 : ext_code_keys_1_2;
+  for(u8 i = 0; l[i]; i++) {
+    if(key == l[i]) return true;
+  }
+  return false;
+}
+
+// copies a null byte terminated list into a sequence
+void kb_seq_list(kb_seq* seq, const u8 *list) {
+  for(seq->len = 0; list[seq->len]; seq->len++) {
+    seq->code[seq->len] = list[seq->len];
+  }
+}
+
+void kb_seq_add(kb_seq* seq, u8 byte) {
+  seq->code[seq->len++] = byte;
+}
+
+// Builds the complete make and break sequences of every key for the active scan code set,
+// so key events and typematic repeats only have to look them up.
+void kb_build_seqs() {
+  memset(kb_make, 0, sizeof(kb_make));
+  memset(kb_break, 0, sizeof(kb_break));
+  
+  for(u8 i = 0; i < KB_SEQS; i++) {
+    u8 key = i > HID2PS2_IDX_MAX ? HID_KEY_CONTROL_LEFT + i - HID2PS2_IDX_MAX - 1 : i;
+    u8 scan_code;
+    
+    switch(scancodeset) {
+      case SCAN_CODE_SET_1: scan_code = IS_MOD_KEY(key) ? mod2ps2_1[key - HID_KEY_CONTROL_LEFT] : hid2ps2_1[key]; break;
+      case SCAN_CODE_SET_2: scan_code = IS_MOD_KEY(key) ? mod2ps2_2[key - HID_KEY_CONTROL_LEFT] : hid2ps2_2[key]; break;
+      default: scan_code = IS_MOD_KEY(key) ? mod2ps2_3[key - HID_KEY_CONTROL_LEFT] : hid2ps2_3[key]; break;
+    }
+    
+    if(!scan_code) continue;
+    kb_make[i].typematic = true;
+    
+    // Some keys require a prefix before the actual code
+    if(scancodeset != SCAN_CODE_SET_3 && kb_is_ext(key)) {
+      kb_seq_add(&kb_make[i], KB_EXT_PFX_E0);
+      kb_seq_add(&kb_break[i], KB_EXT_PFX_E0);
+    }
+    
+    kb_seq_add(&kb_make[i], scan_code);
+    
+    if(scancodeset == SCAN_CODE_SET_1) {
+      kb_seq_add(&kb_break[i], scan_code | 0x80);
+    } else {
+      kb_seq_add(&kb_break[i], KB_BREAK_2_3);
+      kb_seq_add(&kb_break[i], scan_code);
+    }
+  }
+  
+  // PrintScreen and Pause have special sequences that must be sent and are not repeated.
+  // Pause doesn't have a break code.
+  if(scancodeset != SCAN_CODE_SET_3) {
+    bool set1 = scancodeset == SCAN_CODE_SET_1;
+    kb_seq_list(&kb_make[HID_KEY_PRINT_SCREEN], set1 ? prt_scn_make_1 : prt_scn_make_2);
+    kb_seq_list(&kb_break[HID_KEY_PRINT_SCREEN], set1 ? prt_scn_break_1 : prt_scn_break_2);
+    kb_seq_list(&kb_make[HID_KEY_PAUSE], set1 ? pause_make_1 : pause_make_2);
+    kb_seq_list(&kb_ctrl_pause, set1 ? break_make_1 : break_make_2);
+    kb_break[HID_KEY_PAUSE].len = 0;
+    kb_make[HID_KEY_PRINT_SCREEN].typematic = false;
+    kb_make[HID_KEY_PAUSE].typematic = false;
+  }
+}
+
 void set_scancodeset(u8 scs) {
   scancodeset = scs;
-  printf("scancodeset set to %u\n", scancodeset);
+  kb_build_seqs();
+  trace(TR_KB_SCS, scancodeset);
 }
 
 void kb_set_defaults() {
-  printf("Setting defaults for keyboard\n");
+  trace0(TR_KB_DEFAULTS);
+  // the host forgets held keys on reset, so a resync would not be expected either
+  memcpy(kb_host, kb_want, sizeof(kb_host));
+  kb_resync = false;
   kbhost_state = KBH_STATE_IDLE;
   scs3_mode = SCS3_MODE_MAKE_BREAK_TYPEMATIC;
   set_scancodeset(2);
@@ -166,141 +247,115 @@ void kb_set_defaults() {
   repeat_us = 91743;
   delay_ms = 500;
   blinking = true;
-  add_alarm_in_ms(100, blink_callback, NULL, false);
-  #ifdef KBIN
-    ps2in_reset(&kb_in);
-  #endif
+  sched_in_ms(JOB_KB_BLINK, 100, blink_callback);
+  hal_ps2in_reset(PS2_KB);
 }
 
 s64 repeat_cb() {
   if(key2repeat) {
-    switch(scancodeset) {
-      case SCAN_CODE_SET_1:
-        kb_maybe_send_prefix(key2repeat);
-        IS_MOD_KEY(key2repeat) ? kb_send(mod2ps2_1[key2repeat - HID_KEY_CONTROL_LEFT]) : kb_send(hid2ps2_1[key2repeat]);
-      break;
-      case SCAN_CODE_SET_2:
-        kb_maybe_send_prefix(key2repeat);
-        IS_MOD_KEY(key2repeat) ? kb_send(mod2ps2_2[key2repeat - HID_KEY_CONTROL_LEFT]) : kb_send(hid2ps2_2[key2repeat]);
-      break;
-      case SCAN_CODE_SET_3:
-        IS_MOD_KEY(key2repeat) ? kb_send(mod2ps2_3[key2repeat - HID_KEY_CONTROL_LEFT]) : kb_send(hid2ps2_3[key2repeat]);
-      break;
-      default:
-        repeater = 0;
-      return 0;
-    }
+    kb_send_seq(&kb_make[KB_SEQ_IDX(key2repeat)]);
     return repeat_us;
   }
-  repeater = 0;
   return 0;
 }
 
-#define LOG_UNMAPPED_KEY printf("WARNING: Unmapped HID key 0x%x in set %d, ignoring it!\n",key,scancodeset);
-
-void kb_send_key_scs1(u8 key, bool is_key_pressed, bool is_ctrl) {
-
-  // PrintScreen and Pause have special sequences that must be sent.
-  // Pause doesn't have a break code.
-  if(key == HID_KEY_PAUSE || key == HID_KEY_PRINT_SCREEN) {
-    if(is_key_pressed  && key == HID_KEY_PRINT_SCREEN)      kb_send_sc_list(prt_scn_make_1);
-    if(!is_key_pressed && key == HID_KEY_PRINT_SCREEN)      kb_send_sc_list(prt_scn_break_1);
-    if(is_key_pressed  && key == HID_KEY_PAUSE && is_ctrl)  kb_send_sc_list(break_make_1);
-    if(is_key_pressed  && key == HID_KEY_PAUSE && !is_ctrl) kb_send_sc_list(pause_make_1);
-    return;
-  }
-
-  u8 scan_code = IS_MOD_KEY(key) ? mod2ps2_1[key - HID_KEY_CONTROL_LEFT] : hid2ps2_1[key];
-
-  if(!scan_code) {
-    LOG_UNMAPPED_KEY
-    return;
-  }
-
-  // Some keys require a prefix before the actual code
-  kb_maybe_send_prefix(key);
+bool kb_send_key_scs3(u8 key, bool is_key_pressed) {
+  u8 i = KB_SEQ_IDX(key);
+  u8 scan_code = kb_make[i].code[0];
 
   if(is_key_pressed) {
     // Take care of typematic repeat
-    key2repeat = key;
-    if(repeater) cancel_alarm(repeater);
-    repeater = add_alarm_in_ms(delay_ms, repeat_cb, NULL, false);
+    if(
+      (scs3_mode == SCS3_MODE_MAKE_BREAK_TYPEMATIC || scs3_mode == SCS3_MODE_MAKE_TYPEMATIC)
+      && !(scs3keymodemap[scan_code] & KEYMODEMASK_TYPEMATIC)
+    ) {
+      key2repeat = key;
+      sched_in_ms(JOB_KB_REPEAT, delay_ms, repeat_cb);
+    }
 
-    kb_send(scan_code);
+    return kb_send_seq(&kb_make[i]);
   } else {
-    // Cancel repeat
     if(key == key2repeat) key2repeat = 0;
 
-    kb_send(scan_code | 0x80);
+    if(
+      (scs3_mode == SCS3_MODE_MAKE_BREAK || scs3_mode == SCS3_MODE_MAKE_BREAK_TYPEMATIC)
+      && !(scs3keymodemap[scan_code] & KEYMODEMASK_BREAK)
+    ) {
+      return kb_send_seq(&kb_break[i]);
+    }
   }
+  return true;
 }
 
-void kb_send_key_scs2(u8 key, bool is_key_pressed, bool is_ctrl) {
+// Sends the sequence for one key change, returns false if it did not fit
+bool kb_send_change(u8 key, bool is_key_pressed, u8 modifiers) {
+  u8 i = KB_SEQ_IDX(key);
 
-  // PrintScreen and Pause have special sequences that must be sent.
-  // Pause doesn't have a break code.
-  if(key == HID_KEY_PAUSE || key == HID_KEY_PRINT_SCREEN) {
-    if(is_key_pressed  && key == HID_KEY_PRINT_SCREEN)      kb_send_sc_list(prt_scn_make_2);
-    if(!is_key_pressed && key == HID_KEY_PRINT_SCREEN)      kb_send_sc_list(prt_scn_break_2);
-    if(is_key_pressed  && key == HID_KEY_PAUSE && is_ctrl)  kb_send_sc_list(break_make_2);
-    if(is_key_pressed  && key == HID_KEY_PAUSE && !is_ctrl) kb_send_sc_list(pause_make_2);
-    return;
+  if(!kb_make[i].len) {
+    trace(TR_KB_UNMAPPED, key, scancodeset);
+    return true;
   }
 
-  u8 scan_code = IS_MOD_KEY(key) ? mod2ps2_2[key - HID_KEY_CONTROL_LEFT] : hid2ps2_2[key];
-
-  if(!scan_code) {
-    LOG_UNMAPPED_KEY
-    return;
+  if(scancodeset == SCAN_CODE_SET_3) {
+    return kb_send_key_scs3(key, is_key_pressed);
   }
 
-  // Some keys require a prefix before the actual code
-  kb_maybe_send_prefix(key);
-
   if(is_key_pressed) {
-  // Take care of typematic repeat
-    key2repeat = key;
-    if(repeater) cancel_alarm(repeater);
-    repeater = add_alarm_in_ms(delay_ms, repeat_cb, NULL, false);
+    // Take care of typematic repeat
+    if(kb_make[i].typematic) {
+      key2repeat = key;
+      sched_in_ms(JOB_KB_REPEAT, delay_ms, repeat_cb);
+    } else {
+      key2repeat = 0;
+    }
+
+    bool is_ctrl = modifiers & KEYBOARD_MODIFIER_LEFTCTRL || modifiers & KEYBOARD_MODIFIER_RIGHTCTRL;
+    return kb_send_seq(key == HID_KEY_PAUSE && is_ctrl ? &kb_ctrl_pause : &kb_make[i]);
   } else {
-    if(key == key2repeat) key2repeat = 0;
-    kb_send(KB_BREAK_2_3);
+    if(key == key2repeat || !kb_make[i].typematic) key2repeat = 0;
+    return kb_send_seq(&kb_break[i]);
   }
-  kb_send(scan_code);
 }
 
-void kb_send_key_scs3(u8 key, bool is_key_pressed) {
-
-  u8 scan_code = IS_MOD_KEY(key) ? mod2ps2_3[key - HID_KEY_CONTROL_LEFT] : hid2ps2_3[key];
-
-  if(!scan_code) {
-    LOG_UNMAPPED_KEY
-    return;
+void kb_set_bit(u32* keys, u8 key, bool on) {
+  if(on) {
+    keys[key >> 5] |= 1u << (key & 31);
+  } else {
+    keys[key >> 5] &= ~(1u << (key & 31));
   }
+}
 
-  if(is_key_pressed) {
-    // Take care of typematic repeat
-    if(
-      (scs3_mode == SCS3_MODE_MAKE_BREAK_TYPEMATIC || scs3_mode == SCS3_MODE_MAKE_TYPEMATIC)
-      && !(scs3keymodemap[scan_code] & KEYMODEMASK_TYPEMATIC)
-    ) {
-      key2repeat = key;
-      if(repeater) cancel_alarm(repeater);
-      repeater = add_alarm_in_ms(delay_ms, repeat_cb, NULL, false);
+// Brings the host up to the keys held on USB with as few sequences as possible,
+// breaks first. Stops while the PS/2 queue is full and continues from kb_task.
+void kb_resync_step() {
+  for(u8 pressed = 0; pressed < 2; pressed++) {
+    for(u8 w = 0; w < 8; w++) {
+      u32 diff = pressed ? kb_want[w] & ~kb_host[w] : kb_host[w] & ~kb_want[w];
+      while(diff) {
+        u8 key = w * 32 + __builtin_ctz(diff);
+        diff &= diff - 1;
+        if(hal_ps2_room(PS2_KB) < KB_SEQ_MAX || !kb_send_change(key, pressed, kb_want[7] & 0xff)) return;
+        kb_set_bit(kb_host, key, pressed);
+      }
     }
+  }
+  kb_resync = false;
+}
 
-    kb_send(scan_code);
-  } else {
-    if(key == key2repeat) key2repeat = 0;
-
-    if(
-      (scs3_mode == SCS3_MODE_MAKE_BREAK || scs3_mode == SCS3_MODE_MAKE_BREAK_TYPEMATIC)
-      && !(scs3keymodemap[scan_code] & KEYMODEMASK_BREAK)
-    ) {
-      kb_send(KB_BREAK_2_3);
-      kb_send(scan_code);
-    }
+// Takes the keys held on USB after the USB side had to drop changes
+void kb_sync(const u32* keys) {
+  if(!kb_enabled) return;
+  memcpy(kb_want, keys, sizeof(kb_want));
+  for(u16 key = 0; key < 256; key++) {
+    if(!IS_VALID_KEY(key)) kb_set_bit(kb_want, key, false);
   }
+  kb_resync = true;
+  kb_resyncs++;
+}
+
+// True if the next key change can be sent without losing it
+bool kb_ready() {
+  return !kb_enabled || (!kb_resync && hal_ps2_room(PS2_KB) >= KB_SEQ_MAX);
 }
 
 // Sends a key state change to the host
@@ -308,37 +363,30 @@ void kb_send_key_scs3(u8 key, bool is_key_pressed) {
 // bool is_key_pressed - state of key: true=pressed, false=released
 void kb_send_key(u8 key, bool is_key_pressed, u8 modifiers) {
   if(!kb_enabled) {
-    printf("WARNING: Keyboard disabled, ignoring key press %u\n", key);
+    trace(TR_KB_DISABLED, key);
     return;
   }
 
   if(!IS_VALID_KEY(key)) {
-    printf("INFO: Ignoring hid key 0x%x by design.\n", key);
+    trace(TR_KB_IGNORED, key);
     return;
   }
-  
-  bool is_ctrl = modifiers & KEYBOARD_MODIFIER_LEFTCTRL || modifiers & KEYBOARD_MODIFIER_RIGHTCTRL;
-
-  switch(scancodeset) {
-    case SCAN_CODE_SET_1:
-      kb_send_key_scs1(key, is_key_pressed, is_ctrl);
-      break;
-    case SCAN_CODE_SET_2:
-      kb_send_key_scs2(key, is_key_pressed, is_ctrl);
-      break;
-    case SCAN_CODE_SET_3:
-      kb_send_key_scs3(key, is_key_pressed);
-      break;
-    default:
-      printf("INTERNAL ERROR! SCAN CODE SET = %u\n", scancodeset);
-      break;
+
+  kb_set_bit(kb_want, key, is_key_pressed);
+  if(kb_resync) return;
+
+  if(!kb_send_change(key, is_key_pressed, modifiers)) {
+    trace(TR_KB_OVERFLOW, key);
+    kb_overflows++;
+    kb_resyncs++;
+    kb_resync = true;
+    return;
   }
+  kb_set_bit(kb_host, key, is_key_pressed);
 }
 
-const char* notinscs3_str = "WARNING: Scan code set 3 not set. Ignoring command 0x%x\n";
-
 void kb_receive(u8 byte, u8 prev_byte) {
-  printf("host > kb %02x\n", byte);
+  trace(TR_KB_RX, byte);
   switch(kbhost_state) {
     case KBH_STATE_SET_KEY_MAKE_FD:
     case KBH_STATE_SET_KEY_MAKE_BREAK_FC:
@@ -368,9 +416,7 @@ void kb_receive(u8 byte, u8 prev_byte) {
     case KBH_STATE_SET_TYPEMATIC_PARAMS_F3:
       repeat_us = repeats[byte & 0x1f];
       delay_ms = delays[(byte & 0x60) >> 5];
-      #ifdef KBIN
-        ps2in_set(&kb_in, 0xf3, byte);
-      #endif
+      hal_ps2in_set(PS2_KB, 0xf3, byte);
       kbhost_state = KBH_STATE_IDLE;
     break;
 
@@ -385,7 +431,7 @@ void kb_receive(u8 byte, u8 prev_byte) {
           set_scancodeset(byte);
           break;
         default:
-          printf("WARNING: scancodeset requested to set to unknown value %u by host, defaulting to 2\n",byte);
+          trace(TR_KB_SCS_UNKNOWN, byte);
           set_scancodeset(2);
         break;
       }
@@ -396,66 +442,67 @@ void kb_receive(u8 byte, u8 prev_byte) {
     default:
       switch((u8)byte) {
         case KBHOSTCMD_RESET_FF:
-          printf("KBHOSTCMD_RESET_FF\n");
+          trace0(TR_KB_CMD_RESET_FF);
           // We only set defaults, we do not actually reset ourselves.
+          hal_ps2_clear(PS2_KB);
           kb_set_defaults();
           kb_send(KB_MSG_ACK_FA);
           kb_send(KB_MSG_SELFTEST_PASSED_AA);
         return;
 
         case KBHOSTCMD_RESEND_FE:
-          printf("KBHOSTCMD_RESEND_FE\n");
+          trace0(TR_KB_CMD_RESEND_FE);
           kb_resend_last();
           kbhost_state = KBH_STATE_IDLE;
         return;
 
         case KBHOSTCMD_SCS3_SET_KEY_MAKE_FD:
-          printf("KBHOSTCMD_SCS3_SET_KEY_MAKE_FD\n");
+          trace0(TR_KB_CMD_SCS3_SET_KEY_MAKE_FD);
           if(scancodeset == SCAN_CODE_SET_3) {
             kbhost_state = KBH_STATE_SET_KEY_MAKE_FD;
           } else {
-            printf(notinscs3_str,byte);
+            trace(TR_KB_NOT_SCS3, byte);
             kbhost_state = KBH_STATE_IDLE;
           }
         break;
 
         case KBHOSTCMD_SCS3_SET_KEY_MAKE_BREAK_FC:
-          printf("KBHOSTCMD_SCS3_SET_KEY_MAKE_BREAK_FC\n");
+          trace0(TR_KB_CMD_SCS3_SET_KEY_MAKE_BREAK_FC);
           if(scancodeset == SCAN_CODE_SET_3) {
             kbhost_state = KBH_STATE_SET_KEY_MAKE_BREAK_FC;
           } else {
-            printf(notinscs3_str,byte);
+            trace(TR_KB_NOT_SCS3, byte);
             kbhost_state = KBH_STATE_IDLE;
           }
         break;
 
         case KBHOSTCMD_SCS3_SET_KEY_MAKE_TYPEMATIC_FB:
-          printf("KBHOSTCMD_SCS3_SET_KEY_MAKE_TYPEMATIC_FB\n");
+          trace0(TR_KB_CMD_SCS3_SET_KEY_MAKE_TYPEMATIC_FB);
           if(scancodeset == SCAN_CODE_SET_3) {
             kbhost_state = KBH_STATE_SET_KEY_MAKE_TYPEMATIC_FB;
           } else {
-            printf(notinscs3_str,byte);
+            trace(TR_KB_NOT_SCS3, byte);
             kbhost_state = KBH_STATE_IDLE;
           }
         break;
 
 
         case KBHOSTCMD_SCS3_SET_ALL_MAKE_BREAK_TYPEMATIC_FA: 
-          printf("KBHOSTCMD_SCS3_SET_ALL_MAKE_BREAK_TYPEMATIC_FA\n");
+          trace0(TR_KB_CMD_SCS3_SET_ALL_MAKE_BREAK_TYPEMATIC_FA);
           if(scancodeset == SCAN_CODE_SET_3) {
             scs3_mode = SCS3_MODE_MAKE_BREAK_TYPEMATIC;
           } else {
-            printf(notinscs3_str,byte);
+            trace(TR_KB_NOT_SCS3, byte);
           }
           kbhost_state = KBH_STATE_IDLE;
         break;
 
         case KBHOSTCMD_SCS3_SET_ALL_MAKE_F9: 
-          printf("KBHOSTCMD_SCS3_SET_ALL_MAKE_F9\n");
+          trace0(TR_KB_CMD_SCS3_SET_ALL_MAKE_F9);
           if(scancodeset == SCAN_CODE_SET_3) {
             scs3_mode = SCS3_MODE_MAKE;
           } else {
-            printf(notinscs3_str,byte);
+            trace(TR_KB_NOT_SCS3, byte);
           }
           kbhost_state = KBH_STATE_IDLE;
         break;
@@ -463,31 +510,32 @@ void kb_receive(u8 byte, u8 prev_byte) {
         case KBHOSTCMD_SCS3_SET_ALL_MAKE_BREAK_F8: 
           // utilized by SGI O2
           if(scancodeset == SCAN_CODE_SET_3) {
-            printf("KBHOSTCMD_SCS3_SET_ALL_MAKE_BREAK_F8\n");
+            trace0(TR_KB_CMD_SCS3_SET_ALL_MAKE_BREAK_F8);
             scs3_mode = SCS3_MODE_MAKE_BREAK;
           } else {
-            printf(notinscs3_str,byte);
+            trace(TR_KB_NOT_SCS3, byte);
           }
           kbhost_state = KBH_STATE_IDLE;
         break;
 
         case KBHOSTCMD_SCS3_SET_ALL_MAKE_TYPEMATIC_F7:
           if(scancodeset == SCAN_CODE_SET_3) {
-            printf("KBHOSTCMD_SCS3_SET_ALL_MAKE_TYPEMATIC_F7\n");
+            trace0(TR_KB_CMD_SCS3_SET_ALL_MAKE_TYPEMATIC_F7);
             scs3_mode = SCS3_MODE_MAKE_TYPEMATIC;
           } else {
-            printf(notinscs3_str,byte);
+            trace(TR_KB_NOT_SCS3, byte);
           }
           kbhost_state = KBH_STATE_IDLE;
         break;
 
         case KBHOSTCMD_SET_DEFAULT_F6:
-          printf("KBHOSTCMD_SET_DEFAULT_F6\n");
+          trace0(TR_KB_CMD_SET_DEFAULT_F6);
+          hal_ps2_clear(PS2_KB);
           kb_set_defaults();
         break;
         
         case KBHOSTCMD_DISABLE_F5:
-          printf("KBHOSTCMD_DISABLE_F5\n");
+          trace0(TR_KB_CMD_DISABLE_F5);
           // Documentation says this command might also set defaults.
           // In the case of a SGI O2 and generic PS/2 Cherry KB this not true
           // and would prevent the O2 from working.
@@ -497,45 +545,46 @@ void kb_receive(u8 byte, u8 prev_byte) {
           //
           // kb_set_defaults();
           //
+          hal_ps2_clear(PS2_KB);
           kb_enabled = false;
         break;
         
         case KBHOSTCMD_ENABLE_F4:
-          printf("KBHOSTCMD_ENABLE_F4\n");
+          trace0(TR_KB_CMD_ENABLE_F4);
           kb_enabled = true;
           kbhost_state = KBH_STATE_IDLE;
         break;
     
         case KBHOSTCMD_SET_TYPEMATIC_PARAMS_F3:
-          printf("KBHOSTCMD_SET_TYPEMATIC_PARAMS_F3\n");
+          trace0(TR_KB_CMD_SET_TYPEMATIC_PARAMS_F3);
           kbhost_state = KBH_STATE_SET_TYPEMATIC_PARAMS_F3;
         break;
         
         case KBHOSTCMD_READ_ID_F2:
-          printf("KBHOSTCMD_READ_ID_F2\n");
+          trace0(TR_KB_CMD_READ_ID_F2);
           kb_send(KB_MSG_ACK_FA);
           kb_send(KB_MSG_ID1_AB);
           kb_send(KB_MSG_ID2_83);
         return; // ACK already sent
 
         case KBHOSTCMD_SET_SCAN_CODE_SET_F0:
-          printf("KBHOSTCMD_SET_SCAN_CODE_SET_F0\n");
+          trace0(TR_KB_CMD_SET_SCAN_CODE_SET_F0);
           kbhost_state = KBH_STATE_SET_SCAN_CODE_SET_F0;
         break;
         
         case KBHOSTCMD_ECHO_EE:
-          printf("KBHOSTCMD_ECHO_EE\n");
+          trace0(TR_KB_CMD_ECHO_EE);
           kb_send(KB_MSG_ECHO_EE);
           kbhost_state = KBH_STATE_IDLE;
         return;
 
         case KBHOSTCMD_SET_LEDS_ED:
-          printf("KBHOSTCMD_SET_LEDS_ED\n");
+          trace0(TR_KB_CMD_SET_LEDS_ED);
           kbhost_state = KBH_STATE_SET_LEDS_ED;
         break;
 
         default:
-          printf("WARNING: Unknown host cmd: 0x%x, requesting resend from host!\n",byte);
+          trace(TR_KB_UNKNOWN_CMD, byte);
           kb_send(KB_MSG_RESEND_FE);
           kbhost_state = KBH_STATE_IDLE;
         return;
@@ -543,23 +592,21 @@ void kb_receive(u8 byte, u8 prev_byte) {
     break;
   }
   kb_send(KB_MSG_ACK_FA);
+  
+  // scancodes wait until the argument is in
+  if(kbhost_state == KBH_STATE_SET_LEDS_ED || kbhost_state == KBH_STATE_SET_TYPEMATIC_PARAMS_F3 || kbhost_state == KBH_STATE_SET_SCAN_CODE_SET_F0) {
+    hal_ps2_expect(PS2_KB);
+  }
 }
 
 bool kb_task() {
-  ps2out_task(&kb_out);
-  #ifdef KBIN
-    ps2in_task(&kb_in, &kb_out);
-  #endif
-  return kb_enabled && !kb_out.busy;// TODO: return value can probably be void
+  hal_ps2_task(PS2_KB);
+  if(kb_resync && kb_enabled) kb_resync_step();
+  return kb_enabled && !hal_ps2_busy(PS2_KB);// TODO: return value can probably be void
 }
 
 void kb_init(u8 gpio_out, u8 gpio_in) {
-  ps2out_init(&kb_out, pio1, gpio_out, &kb_receive);
-  #ifdef KBIN
-    ps2in_init(&kb_in, pio0, gpio_in);
-  #else
-    (void)gpio_in;
-  #endif
+  hal_ps2_init(PS2_KB, gpio_out, gpio_in, &kb_receive);
   kb_set_defaults();
   kb_send(KB_MSG_SELFTEST_PASSED_AA);
 }
@@ -25,119 +25,208 @@
  */
 #include "ps2x2pico.h"
 
-ps2out ms_out;
-ps2in ms_in;
-
 #ifndef MS_RATE_DEFAULT
   #define MS_RATE_HOST_CONTROL
   #define MS_RATE_DEFAULT 100
 #endif
 
+// USB counts per PS/2 count at the default resolution of 4 counts/mm
+#ifndef MS_DPI_DIV
+  #define MS_DPI_DIV 1
+#endif
+
+// Movement that is still to be sent is capped at 16 full packets per axis,
+// the rest is dropped and reported with the overflow bits
+#define MS_CARRY_MAX 4080
+
+// Movement is added up in 1/MS_UNIT of a PS/2 count, so no fraction gets lost
+#define MS_UNIT (4 * MS_DPI_DIV)
+
+// Button changes not sent yet, each gets a packet of its own
+#define MS_CLICKS 16
+
 bool ms_streaming = false;
+volatile bool ms_ready = false; // the host's sample interval since the last packet is over
+bool ms_remote = false;
+bool ms_scaling = false; // 2:1
 bool ms_ismoving = false;
 u32 ms_magic_seq = 0;
 u8 ms_type = 0;
 u8 ms_rate = MS_RATE_DEFAULT;
+u8 ms_res = 2; // 1 << ms_res counts/mm
 u8 ms_db = 0;
-s16 ms_dx = 0;
-s16 ms_dy = 0;
+s32 ms_dx = 0;
+s32 ms_dy = 0;
 s8 ms_dz = 0;
+u8 ms_overflow = 0;
+u8 ms_clicks[MS_CLICKS];
+u8 ms_click_head = 0;
+u8 ms_click_count = 0;
+u32 ms_clicks_lost = 0;
+u8 ms_buttons[MS_SOURCES] = {0};
 
 void ms_reset() {
   ms_ismoving = false;
   ms_db = 0;
+  ms_click_count = 0;
   ms_dx = 0;
   ms_dy = 0;
   ms_dz = 0;
+  ms_overflow = 0;
 }
 
 void ms_send(u8 byte) {
-  if(!ms_streaming) printf("ms > host %02x\n", byte);
-  queue_try_add(&ms_out.qbytes, &byte);
+  if(!ms_streaming) trace(TR_MS_TX, byte);
+  hal_ps2_send(PS2_MS, byte);
 }
 
 s64 ms_reset_callback() {
   ms_send(0xaa);
   ms_send(ms_type);
-  #ifdef MSIN
-    ps2in_reset(&ms_in);
-  #endif
+  hal_ps2in_reset(PS2_MS);
+  ms_buttons[MS_PS2IN] = 0;
   return 0;
 }
 
-u8 ms_clamp_xyz(s16 xyz) {
-  if(xyz < -255) return 1;
-  if(xyz > 255) return 255;
-  return xyz;
+// Adds counts to an axis at the host's resolution, returns the overflow bit if some were dropped.
+// Only USB counts are divided by MS_DPI_DIV, the passthrough mouse counts in PS/2 counts already.
+u8 ms_add_xy(u8 source, s32* xy, s32 counts, u8 overflow) {
+  if(source == MS_PS2IN) counts *= MS_DPI_DIV;
+  s64 value = *xy + (s64)counts * (1 << ms_res);
+  s32 max = MS_CARRY_MAX * MS_UNIT;
+  *xy = value > max ? max : value < -max ? -max : value;
+  return *xy == value ? 0 : overflow;
 }
 
-s16 ms_remain_xyz(s16 xyz) {
-  if(xyz < -255) return xyz + 255;
-  if(xyz > 255) return xyz - 255;
-  return 0;
+// PS/2 counts for the next packet, at most what fits into 9 bits.
+// The rest stays for the packets after it.
+s16 ms_take_xy(s32* xy, s16 max) {
+  s32 counts = *xy / MS_UNIT;
+  if(counts > max) counts = max;
+  if(counts < -max) counts = -max;
+  *xy -= counts * MS_UNIT;
+  return counts;
 }
 
-s64 ms_send_callback() {
-  if(!ms_streaming) return 0;
-
-  if(!ms_out.busy) {
-    if(!ms_db && !ms_dx && !ms_dy && !ms_dz) {
-      if(!ms_ismoving) {
-        return 1000000 / ms_rate;
-      }
+// 2:1 scaling of stream mode
+s16 ms_scale(s16 counts) {
+  static const u8 small[6] = { 0, 1, 1, 3, 6, 9 };
+  s16 size = counts < 0 ? -counts : counts;
+  size = size < 6 ? small[size] : size * 2;
+  return counts < 0 ? -size : size;
+}
 
-      ms_ismoving = false;
-    } else {
-      ms_ismoving = true;
-    }
+bool ms_moving() {
+  return ms_db || ms_click_count || ms_dx / MS_UNIT || ms_dy / MS_UNIT || ms_dz;
+}
 
-    u8 byte1 = 0x08 | (ms_db & 0x07);
-    u8 byte2 = ms_clamp_xyz(ms_dx);
-    u8 byte3 = 0x100 - ms_clamp_xyz(ms_dy);
-    s8 byte4 = 0x100 - ms_dz;
+// Queues one movement packet with the oldest button change not sent yet,
+// false if it did not fit. The movement and the change are kept then.
+bool ms_send_packet(bool scale) {
+  u8 buttons = ms_click_count ? ms_clicks[ms_click_head] : ms_db;
+  s32 dx = ms_dx;
+  s32 dy = ms_dy;
+  s16 x = ms_take_xy(&dx, scale ? 127 : 255);
+  s16 y = -ms_take_xy(&dy, scale ? 127 : 255);
+  if(scale) {
+    x = ms_scale(x);
+    y = ms_scale(y);
+  }
 
-    if(ms_dx < 0) byte1 |= 0x10;
-    if(ms_dy > 0) byte1 |= 0x20;
-    if(byte2 == 0xaa) byte2 = 0xab;
-    if(byte3 == 0xaa) byte3 = 0xab;
+  u8 byte1 = 0x08 | (buttons & 0x07) | ms_overflow;
+  u8 byte2 = x;
+  u8 byte3 = y;
+  s8 byte4 = 0x100 - ms_dz;
 
-    ms_send(byte1);
-    ms_send(byte2);
-    ms_send(byte3);
+  if(x < 0) byte1 |= 0x10;
+  if(y < 0) byte1 |= 0x20;
+  if(byte2 == 0xaa) byte2 = 0xab;
+  if(byte3 == 0xaa) byte3 = 0xab;
 
-    if(ms_type == 3 || ms_type == 4) {
-      if(byte4 < -8) byte4 = -8;
-      if(byte4 > 7) byte4 = 7;
+  u8 packet[4] = { byte1, byte2, byte3 };
+  u8 len = 3;
 
-      if(ms_type == 4) {
-        byte4 &= 0x0f;
-        byte4 |= (ms_db << 1) & 0x30;
-      }
+  if(ms_type == 3 || ms_type == 4) {
+    if(byte4 < -8) byte4 = -8;
+    if(byte4 > 7) byte4 = 7;
 
-      ms_send(byte4);
+    if(ms_type == 4) {
+      byte4 &= 0x0f;
+      byte4 |= (buttons << 1) & 0x30;
     }
 
-    ms_dx = ms_remain_xyz(ms_dx);
-    ms_dy = ms_remain_xyz(ms_dy);
-    ms_dz = 0;
+    packet[len++] = byte4;
   }
 
-  return 1000000 / ms_rate;
-}
+  if(!hal_ps2_send_packet(PS2_MS, packet, len)) return false;
 
-void ms_send_movement(u8 buttons, s8 x, s8 y, s8 z) {
+  ms_dx = dx;
+  ms_dy = dy;
+  ms_dz = 0;
+  ms_overflow = 0;
   ms_db = buttons;
-  ms_dx += x;
-  ms_dy += y;
+  if(ms_click_count) {
+    ms_click_head = (ms_click_head + 1) % MS_CLICKS;
+    ms_click_count--;
+  }
+  return true;
+}
+
+s64 ms_send_callback() {
+  ms_ready = true;
+  return 0;
+}
+
+// Called from the main loop. The movement added up so far goes out as soon as the bus is idle
+// and, unless MS_LOW_LATENCY, the host's sample interval since the last packet is over.
+// Building the packet at the last moment keeps it fresh, whatever the USB polling rate.
+// A button change does not wait for the interval, and leaves it running.
+void ms_stream() {
+  if(!ms_streaming || ms_remote || hal_ps2_busy(PS2_MS)) return;
+
+  bool click = ms_click_count;
+  if(!ms_ready && !click) return;
+
+  // one more packet after the movement stopped reports it at rest
+  bool moving = ms_moving();
+  if(!moving && !ms_ismoving) return;
+  if(!ms_send_packet(ms_scaling)) return;
+  ms_ismoving = moving;
+  if(click) return;
+
+  #ifndef MS_LOW_LATENCY
+    ms_ready = false;
+    sched_in_us(JOB_MS_SEND, 1000000 / ms_rate, ms_send_callback);
+  #endif
+}
+
+// Movement is added up, button changes are kept in order.
+// If too many wait, the newest is replaced and one press and release pair is lost.
+void ms_send_movement(u8 source, u8 buttons, s32 x, s32 y, s8 z) {
+  ms_buttons[source] = buttons;
+  buttons = 0;
+  for(u8 i = 0; i < MS_SOURCES; i++) buttons |= ms_buttons[i];
+
+  u8 last = ms_click_count ? ms_clicks[(ms_click_head + ms_click_count - 1) % MS_CLICKS] : ms_db;
+  if(buttons != last) {
+    if(ms_click_count < MS_CLICKS) {
+      ms_click_count++;
+    } else {
+      ms_clicks_lost++;
+    }
+    ms_clicks[(ms_click_head + ms_click_count - 1) % MS_CLICKS] = buttons;
+  }
+  ms_overflow |= ms_add_xy(source, &ms_dx, x, 0x40);
+  ms_overflow |= ms_add_xy(source, &ms_dy, y, 0x80);
   ms_dz += z;
 }
 
 void ms_receive(u8 byte, u8 prev_byte) {
-  printf("host > ms %02x\n", byte);
+  trace(TR_MS_RX, byte);
   switch (prev_byte) {
     case 0xf3: // Set Sample Rate
       #ifdef MS_RATE_HOST_CONTROL
-        ms_rate = byte;
+        if(byte) ms_rate = byte;
       #endif
 
       ms_magic_seq = ((ms_magic_seq << 8) | byte) & 0xffffff;
@@ -151,24 +240,36 @@ void ms_receive(u8 byte, u8 prev_byte) {
       ms_reset();
     break;
 
+    case 0xe8: // Set Resolution
+      ms_res = byte & 3;
+      ms_reset();
+    break;
+
     default:
       switch(byte) {
         case 0xff: // Reset
-          add_alarm_in_ms(100, ms_reset_callback, NULL, false);
+          sched_in_ms(JOB_MS_RESET, 100, ms_reset_callback);
           ms_type = 0;
           // fall through
         case 0xf6: // Set Defaults
           ms_rate = MS_RATE_DEFAULT;
+          ms_res = 2;
+          ms_scaling = false;
+          ms_remote = false;
           // fall through
         case 0xf5: // Disable Data Reporting
+          hal_ps2_clear(PS2_MS);
           ms_streaming = false;
+          ms_ready = false;
+          sched_cancel(JOB_MS_SEND);
           ms_reset();
         break;
 
         case 0xf4: // Enable Data Reporting
           ms_streaming = true;
+          ms_ready = false;
           ms_reset();
-          add_alarm_in_ms(100, ms_send_callback, NULL, false);
+          sched_in_ms(JOB_MS_SEND, 100, ms_send_callback);
         break;
 
         case 0xf2: // Get Device ID
@@ -177,14 +278,43 @@ void ms_receive(u8 byte, u8 prev_byte) {
           ms_reset();
         return;
 
-        case 0xeb: // Read Data
-          ms_ismoving = true;
+        case 0xf0: // Set Remote Mode
+          ms_remote = true;
+          ms_ready = false;
+          sched_cancel(JOB_MS_SEND);
+          ms_reset();
         break;
-        
+
+        case 0xea: // Set Stream Mode
+          ms_remote = false;
+          ms_ready = false;
+          ms_reset();
+          if(ms_streaming) sched_in_us(JOB_MS_SEND, 1000000 / ms_rate, ms_send_callback);
+        break;
+
+        case 0xeb: // Read Data, the packet follows the ACK and is never scaled
+          ms_send(0xfa);
+          // the ACK must be followed by a packet, make room for it if needed
+          if(!ms_send_packet(false)) {
+            hal_ps2_clear(PS2_MS);
+            ms_send_packet(false);
+          }
+          ms_ismoving = false;
+        return;
+
+        case 0xe6: // Set Scaling 1:1
+          ms_scaling = false;
+        break;
+
+        case 0xe7: // Set Scaling 2:1
+          ms_scaling = true;
+        break;
+
         case 0xe9: // Status Request
           ms_send(0xfa);
-          ms_send(ms_streaming << 5); // Bit6: Mode, Bit 5: Enable, Bit 4: Scaling, Bits[2,1,0] = Buttons[L,M,R]
-          ms_send(0x02); // Resolution
+          // Bit6: Mode, Bit 5: Enable, Bit 4: Scaling, Bits[2,1,0] = Buttons[L,M,R]
+          ms_send(ms_remote << 6 | ms_streaming << 5 | ms_scaling << 4 | (ms_db & 1) << 2 | (ms_db & 4) >> 1 | (ms_db & 2) >> 1);
+          ms_send(ms_res); // Resolution
           ms_send(ms_rate); // Sample Rate
         return;
         
@@ -196,22 +326,20 @@ void ms_receive(u8 byte, u8 prev_byte) {
   }
   
   ms_send(0xfa);
+  
+  // Set Sample Rate and Set Resolution, movement waits until the argument is in
+  if((byte == 0xf3 || byte == 0xe8) && prev_byte != 0xf3 && prev_byte != 0xe8) {
+    hal_ps2_expect(PS2_MS);
+  }
 }
 
 bool ms_task() {
-  ps2out_task(&ms_out);
-  #ifdef MSIN
-    ps2in_task(&ms_in, &ms_out);
-  #endif
-  return ms_streaming && !ms_out.busy;
+  hal_ps2_task(PS2_MS);
+  ms_stream();
+  return ms_streaming && !hal_ps2_busy(PS2_MS);
 }
 
 void ms_init(u8 gpio_out, u8 gpio_in) {
-  ps2out_init(&ms_out, pio1, gpio_out, &ms_receive);
-  #ifdef MSIN
-    ps2in_init(&ms_in, pio0, gpio_in);
-  #else
-    (void)gpio_in;
-  #endif
+  hal_ps2_init(PS2_MS, gpio_out, gpio_in, &ms_receive);
   ms_reset_callback();
 }
@@ -23,11 +23,24 @@
  * THE SOFTWARE.
  *
  */
-#include "ps2x2pico.h"
+#include "hal_pico.h"
 #include "ps2out.pio.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#ifdef PS2OUT_DMA
+  #include "hardware/dma.h"
+#endif
+
+// PIO flags are relative to the state machine, so there can be at most two ps2out per PIO
+#define PS2OUT_IRQ_BUSY(sm) (sm)
+#define PS2OUT_IRQ_INHIBIT(sm) (((sm) + 2) & 3)
 
 s8 ps2out_prog = -1;
-u8 ps2out_locked = 0;
+ps2out* ps2out_ports[2][4];
+
+void ps2out_irq0();
+void ps2out_irq1();
 
 u32 ps2_frame(u8 byte) {
   bool parity = 1;
@@ -42,86 +55,433 @@ void ps2out_init(ps2out* this, PIO pio, u8 data_pin, rx_callback rx) {
     ps2out_prog = pio_add_program(pio, &ps2out_program);
   }
   
-  queue_init(&this->qbytes, sizeof(u8), 9);
-  queue_init(&this->qpacks, sizeof(u8) * 9, 16);
+  this->byte_head = 0;
+  this->byte_tail = 0;
+  this->pack_head = 0;
+  this->pack_tail = 0;
+  this->reply_head = 0;
+  this->reply_tail = 0;
+  this->replying = false;
+  this->hold = false;
+  this->arg_pending = false;
+  this->arg_until = 0;
+  this->max_level = 0;
+  this->dropped = 0;
+  this->restarts = 0;
+  this->retries = 0;
+  this->retried = 0;
+  this->retry_max = 0;
   
   this->sm = pio_claim_unused_sm(pio, true);
-  ps2out_program_init(pio, this->sm, ps2out_prog, data_pin);
   
   this->pio = pio;
   this->sent = 0;
   this->rx = rx;
   this->last_rx = 0;
   this->last_tx = 0;
+  this->prev_tx = 0;
   this->busy = 0;
+  this->gap_us = PS2OUT_GAP_US;
+  this->ready = 0;
+  this->ack_pending = false;
+  this->rx_cmd = 0;
+  this->tx_pending = false;
+  memset(&this->ack, 0, sizeof(this->ack));
+  memset(&this->input, 0, sizeof(this->input));
+  memset(&this->queue, 0, sizeof(this->queue));
+  memset(&this->bus, 0, sizeof(this->bus));
+  memset(this->cmds, 0, sizeof(this->cmds));
+  
+  // host bytes and inhibits are handled from the PIO interrupt, on the core calling this
+  u8 irq = pio_get_index(pio) ? PIO1_IRQ_0 : PIO0_IRQ_0;
+  if(!ps2out_ports[pio_get_index(pio)][0] && !ps2out_ports[pio_get_index(pio)][1]) {
+    irq_set_exclusive_handler(irq, pio_get_index(pio) ? ps2out_irq1 : ps2out_irq0);
+  }
+  ps2out_ports[pio_get_index(pio)][this->sm] = this;
+  pio_set_irq0_source_enabled(pio, pis_sm0_rx_fifo_not_empty + this->sm, true);
+  pio_set_irq0_source_enabled(pio, pis_interrupt0 + PS2OUT_IRQ_INHIBIT(this->sm), true);
+  irq_set_enabled(irq, true);
+  
+  #ifdef PS2OUT_DMA
+    // paced by the TX FIFO, the PIO pulls the next frame as soon as it is done with one
+    this->dma = dma_claim_unused_channel(true);
+    this->dma_count = 0;
+    dma_channel_config c = dma_channel_get_default_config(this->dma);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_dreq(&c, pio_get_dreq(pio, this->sm, true));
+    dma_channel_configure(this->dma, &c, &pio->txf[this->sm], this->frames, 0, false);
+  #endif
+  
+  ps2out_program_init(pio, this->sm, ps2out_prog, data_pin);
 }
 
-void ps2out_task(ps2out* this) {
-  u8 i = 0;
-  u8 byte;
-  u8 pack[9];
-  
-  if(!queue_is_empty(&this->qbytes)) {
-    while(i < 9 && queue_try_remove(&this->qbytes, &byte)) {
-      i++;
-      pack[i] = byte;
-    }
-    
-    pack[0] = i;
-    queue_try_add(&this->qpacks, &pack);
+// Queues a packet, returns false and drops it if there is no room for all of it.
+// origin is the time_us_32() of the input that caused it, 0 for replies and repeats.
+// Producers on the consuming core may run in thread or alarm context, so the
+// write is done with interrupts disabled.
+bool ps2out_send(ps2out* this, const u8* bytes, u8 len, u32 origin) {
+  u32 irq = save_and_disable_interrupts();
+  u8 head = this->byte_head;
+  u8 level = head - this->byte_tail;
+  
+  if(!len || len > PS2OUT_BYTES - level || (u8)(this->pack_head - this->pack_tail) == PS2OUT_PACKS) {
+    this->dropped++;
+    restore_interrupts(irq);
+    return false;
   }
   
-  if(pio_interrupt_get(this->pio, this->sm)) {
-    this->busy = 1;
-  } else {
-    this->busy &= 2;
+  for(u8 i = 0; i < len; i++) {
+    this->bytes[(u8)(head + i) % PS2OUT_BYTES] = bytes[i];
   }
   
-  if(pio_interrupt_get(this->pio, this->sm + 4)) {
-    if(this->sent > 0) this->sent--;
-    pio_interrupt_clear(this->pio, this->sm + 4);
+  ps2out_pack* pack = &this->packs[this->pack_head % PS2OUT_PACKS];
+  pack->start = head;
+  pack->len = len;
+  pack->retries = 0;
+  pack->queued = time_us_32();
+  pack->origin = origin;
+  
+  // bytes and descriptor must be visible before the consumer sees the new head
+  __dmb();
+  this->byte_head = head + len;
+  this->pack_head++;
+  
+  if(level + len > this->max_level) this->max_level = level + len;
+  restore_interrupts(irq);
+  return true;
+}
+
+// Queues a reply to a host command. It goes out after the packet on the wire, ahead of
+// everything ps2out_send() queued. Replies come from the core handling the port.
+bool ps2out_reply(ps2out* this, u8 byte) {
+  u32 irq = save_and_disable_interrupts();
+  u8 head = this->reply_head;
+  
+  if((u8)(head - this->reply_tail) == PS2OUT_REPLIES) {
+    this->dropped++;
+    restore_interrupts(irq);
+    return false;
   }
   
-  if(ps2out_locked && !this->busy) ps2out_locked--;
+  this->replies[head % PS2OUT_REPLIES] = byte;
+  __dmb();
+  this->reply_head = head + 1;
+  restore_interrupts(irq);
+  return true;
+}
+
+// The host byte just received is a command that takes an argument, queued
+// packets wait for it. Called from the receive callback.
+void ps2out_expect(ps2out* this) {
+  this->arg_pending = true;
+  this->arg_until = time_us_64() + PS2OUT_ARG_US;
+}
+
+// Drops the queued packets, for reset and disable. Called from the receive callback,
+// descriptor by descriptor as the producer may be on the other core.
+void ps2out_clear(ps2out* this) {
+  while(this->pack_tail != this->pack_head) {
+    ps2out_pack* pack = &this->packs[this->pack_tail % PS2OUT_PACKS];
+    this->byte_tail = pack->start + pack->len;
+    this->pack_tail++;
+  }
+  this->sent = 0;
+  this->tx_pending = false;
+}
+
+// Packets are held while a host command is answered and until its argument arrived
+bool ps2out_held(ps2out* this) {
+  if(!this->hold) return false;
+  if(this->replying || this->reply_tail != this->reply_head) return true;
+  if(this->arg_pending && time_us_64() < this->arg_until) return true;
+  this->hold = false;
+  this->arg_pending = false;
+  return false;
+}
+
+u8 ps2out_level(ps2out* this) {
+  return this->byte_head - this->byte_tail;
+}
+
+// bytes ps2out_send() takes as one packet right now
+u8 ps2out_room(ps2out* this) {
+  if((u8)(this->pack_head - this->pack_tail) == PS2OUT_PACKS) return 0;
+  return PS2OUT_BYTES - ps2out_level(this);
+}
+
+void ps2out_hist_add(ps2out_hist* hist, u32 us) {
+  u8 bucket = 0;
+  while(bucket < PS2OUT_HIST - 1 && us >= 8u << bucket) bucket++;
+  hist->count[bucket]++;
+  if(us > hist->max) hist->max = us;
+}
+
+// A byte the host did not get in full, or asked for again, goes out once more.
+// packet is true if it belongs to the packet on the wire.
+void ps2out_retry(ps2out* this, bool packet) {
+  this->retries++;
+  if(packet) this->packs[this->pack_tail % PS2OUT_PACKS].retries++;
+}
+
+// Reply time of the last host command, commands past the first PS2OUT_CMDS are not counted
+void ps2out_cmd_add(ps2out* this, u32 us) {
+  for(u8 i = 0; i < PS2OUT_CMDS; i++) {
+    ps2out_cmd* cmd = &this->cmds[i];
+    if(cmd->count && cmd->cmd != this->rx_cmd) continue;
+    cmd->cmd = this->rx_cmd;
+    cmd->count++;
+    cmd->sum += us;
+    if(us > cmd->max) cmd->max = us;
+    return;
+  }
+}
+
+// Consumer side of the rings, called from the task with interrupts disabled or from the PIO interrupt
+void ps2out_next(ps2out* this) {
+  while(!this->busy && time_us_64() >= this->ready) {
+    // the clock of a host command stops once the first byte of its reply is on the wire
+    if(this->replying) {
+      this->replying = false;
+      this->reply_tail++;
+      if(this->ack_pending) {
+        u32 us = time_us_32() - this->rx_time;
+        ps2out_hist_add(&this->ack, us);
+        ps2out_cmd_add(this, us);
+        this->ack_pending = false;
+      }
+      continue;
+    }
+    
+    ps2out_pack* pack = this->pack_tail != this->pack_head ? &this->packs[this->pack_tail % PS2OUT_PACKS] : 0;
+    
+    if(pack && this->sent == pack->len) {
+      if(pack->retries) {
+        this->retried++;
+        if(pack->retries > this->retry_max) this->retry_max = pack->retries;
+      }
+      this->sent = 0;
+      this->tx_pending = false;
+      this->byte_tail += pack->len;
+      this->pack_tail++;
+      continue;
+    }
+    
+    // a reply inside a packet would be taken for part of its scancode
+    bool reply = !this->sent && this->reply_tail != this->reply_head;
+    if(!reply && (!pack || ps2out_held(this))) break;
+    
+    if(reply) {
+      this->prev_tx = this->last_tx;
+      this->last_tx = this->replies[this->reply_tail % PS2OUT_REPLIES];
+      this->replying = true;
+      this->busy |= 2;
+      pio_sm_put(this->pio, this->sm, ps2_frame(this->last_tx));
+      continue;
+    }
+    
+    // an inhibit may send the first byte again, the packet started with the first try
+    u32 now = time_us_32();
+    if(!this->sent && !this->tx_pending) {
+      ps2out_hist_add(&this->queue, now - pack->queued);
+      if(pack->origin) ps2out_hist_add(&this->input, now - pack->origin);
+      this->tx_pending = true;
+      this->tx_time = now;
+    }
+    
+    #ifdef PS2OUT_DMA
+      u8 count = pack->len - this->sent;
+      if(count > PS2OUT_FRAMES) count = PS2OUT_FRAMES;
+      
+      this->prev_tx = this->last_tx;
+      for(u8 i = 0; i < count; i++) {
+        this->last_tx = this->bytes[(u8)(pack->start + this->sent + i) % PS2OUT_BYTES];
+        this->frames[i] = ps2_frame(this->last_tx);
+      }
+      
+      this->dma_count = count;
+      this->busy |= 2;
+      dma_channel_transfer_from_buffer_now(this->dma, this->frames, count);
+    #else
+      this->prev_tx = this->last_tx;
+      this->last_tx = this->bytes[(u8)(pack->start + this->sent) % PS2OUT_BYTES];
+      this->sent++;
+      this->busy |= 2;
+      pio_sm_put(this->pio, this->sm, ps2_frame(this->last_tx));
+    #endif
+  }
+}
+
+#ifdef PS2OUT_DMA
+// True while the PIO loops through restart, receivecheck and sendcheck with an empty ISR
+// and nothing left to read from the RX FIFO, so the ISR and RX FIFO can be borrowed.
+bool ps2out_idle(ps2out* this) {
+  u8 pc = pio_sm_get_pc(this->pio, this->sm) - ps2out_prog;
+  return pio_sm_is_rx_fifo_empty(this->pio, this->sm) && (pc < 3 || pc == ps2out_offset_sendcheck || pc == ps2out_offset_sendcheck + 1);
+}
+
+// Reads the OSR through the ISR, see ps2out_idle() for when this is safe
+u32 ps2out_osr(ps2out* this) {
+  pio_sm_set_enabled(this->pio, this->sm, false);
+  pio_sm_exec(this->pio, this->sm, pio_encode_mov(pio_isr, pio_osr));
+  pio_sm_exec(this->pio, this->sm, pio_encode_push(false, false));
+  pio_sm_set_enabled(this->pio, this->sm, true);
+  return pio_sm_get(this->pio, this->sm);
+}
+
+// Called on inhibit while a DMA transfer is running. The PIO has dropped the frame it was
+// sending, everything before it reached the host. The SM is restarted to get rid of the
+// frames that were already pulled into the FIFO and OSR.
+void ps2out_dma_rollback(ps2out* this) {
+  dma_channel_abort(this->dma);
+  u8 pulled = this->dma_count - dma_channel_hw_addr(this->dma)->transfer_count - pio_sm_get_tx_fifo_level(this->pio, this->sm);
   
-  if(!queue_is_empty(&this->qpacks) && !this->busy && !ps2out_locked) {
-    if(queue_try_peek(&this->qpacks, &pack)) {
-      if(this->sent == pack[0]) {
-        this->sent = 0;
-        queue_try_remove(&this->qpacks, &pack);
-      } else {
-        this->sent++;
-        this->last_tx = pack[this->sent];
-        this->busy |= 2;
-        ps2out_locked = 160;
-        pio_sm_put(this->pio, this->sm, ps2_frame(this->last_tx));
+  // autopull refills the OSR right after the inhibited frame was thrown away, if there was one more.
+  // The PIO waits on the inhibit flag in the send path, its ISR is empty and so is the RX FIFO.
+  if(ps2out_osr(this) && pulled) pulled--;
+  
+  pio_sm_set_enabled(this->pio, this->sm, false);
+  pio_sm_clear_fifos(this->pio, this->sm);
+  pio_sm_restart(this->pio, this->sm);
+  pio_sm_exec(this->pio, this->sm, pio_encode_jmp(ps2out_prog));
+  pio_interrupt_clear(this->pio, PS2OUT_IRQ_INHIBIT(this->sm));
+  pio_sm_set_enabled(this->pio, this->sm, true);
+  
+  // the host has everything up to the frame that was thrown away, if one was pulled at all
+  this->dma_count = 0;
+  if(!pulled) return;
+  this->sent += pulled - 1;
+  ps2out_retry(this, true);
+  if(pulled > 1) {
+    this->last_tx = this->bytes[(u8)(this->packs[this->pack_tail % PS2OUT_PACKS].start + this->sent - 1) % PS2OUT_BYTES];
+  } else {
+    this->last_tx = this->prev_tx;
+  }
+}
+#endif
+
+void ps2out_irq(ps2out* this) {
+  if(pio_interrupt_get(this->pio, PS2OUT_IRQ_INHIBIT(this->sm))) {
+    #ifdef PS2OUT_DMA
+      if(this->dma_count) {
+        ps2out_dma_rollback(this);
+      } else
+    #endif
+    {
+      // The host pulled the clock low mid-byte, the PIO restarts once the flag is cleared.
+      // The packet goes on with the same byte, it has not reached the host.
+      ps2out_retry(this, !this->replying && this->sent > 0);
+      this->last_tx = this->prev_tx;
+      if(this->replying) {
+        this->replying = false;
+      } else if(this->sent > 0) {
+        this->sent--;
       }
+      pio_interrupt_clear(this->pio, PS2OUT_IRQ_INHIBIT(this->sm));
     }
   }
   
-  if(!pio_sm_is_rx_fifo_empty(this->pio, this->sm)) {
+  while(!pio_sm_is_rx_fifo_empty(this->pio, this->sm)) {
     u32 fifo = pio_sm_get(this->pio, this->sm) >> 23;
     
     bool parity = 1;
-    for(i = 0; i < 8; i++) {
+    for(u8 i = 0; i < 8; i++) {
       parity = parity ^ (fifo >> i & 1);
     }
     
     if(parity != fifo >> 8) {
       pio_sm_put(this->pio, this->sm, ps2_frame(0xfe));
-      return;
+      continue;
     }
     
+    // resend command, the byte the host got last went wrong on the wire
     if((fifo & 0xff) == 0xfe) {
+      ps2out_retry(this, !this->replying && this->sent > 0 && this->pack_tail != this->pack_head);
       pio_sm_put(this->pio, this->sm, ps2_frame(this->last_tx));
-      return;
+      continue;
     }
     
-    while(queue_try_remove(&this->qbytes, &byte));
-    while(queue_try_remove(&this->qpacks, &pack));
-    this->sent = 0;
+    // The PIO is still busy with its ACK, so only stop feeding it. At most the frame it
+    // already holds in the OSR goes out, same as with a single pio_sm_put.
+    #ifdef PS2OUT_DMA
+      if(this->dma_count) {
+        dma_channel_abort(this->dma);
+        pio_sm_drain_tx_fifo(this->pio, this->sm);
+        this->dma_count = 0;
+      }
+    #endif
+    
+    // Queued packets stay, they follow the reply. One the host cut short goes out again
+    // in full, only replies to an earlier command are dropped.
+    if(this->pack_tail != this->pack_head && this->sent && this->sent < this->packs[this->pack_tail % PS2OUT_PACKS].len) {
+      this->sent = 0;
+      this->restarts++;
+    }
+    this->reply_tail = this->reply_head;
+    this->replying = false;
+    this->hold = true;
+    this->arg_pending = false;
+    this->rx_cmd = (fifo & 0xff) >= 0xe0 ? fifo : this->last_rx; // a data byte counts for its command
+    this->rx_time = time_us_32();
+    this->ack_pending = true;
     
     (*this->rx)(fifo, this->last_rx);
     this->last_rx = fifo;
+    
+    // The PIO is still clocking out its ACK bit here, a reply queued now is sent right after it.
+    // The host byte took longer on the wire than the gap between two bytes.
+    this->busy = 0;
+    this->ready = 0;
+    ps2out_next(this);
   }
 }
+
+void ps2out_irq_handler(u8 pio) {
+  for(u8 sm = 0; sm < 4; sm++) {
+    if(ps2out_ports[pio][sm]) ps2out_irq(ps2out_ports[pio][sm]);
+  }
+}
+
+void ps2out_irq0() {
+  ps2out_irq_handler(0);
+}
+
+void ps2out_irq1() {
+  ps2out_irq_handler(1);
+}
+
+void ps2out_task(ps2out* this) {
+  u32 irq = save_and_disable_interrupts();
+  
+  if(pio_interrupt_get(this->pio, PS2OUT_IRQ_BUSY(this->sm))) {
+    this->busy = 1;
+  } else {
+    this->busy &= 2;
+  }
+  
+  #ifdef PS2OUT_DMA
+    if(this->dma_count) {
+      // the last frame may still wait in the OSR while the PIO goes from one byte to the next
+      if(!(this->busy & 1) && !dma_channel_is_busy(this->dma) && pio_sm_is_tx_fifo_empty(this->pio, this->sm) && ps2out_idle(this) && !ps2out_osr(this)) {
+        this->sent += this->dma_count;
+        this->dma_count = 0;
+        this->busy = 0;
+      } else {
+        this->busy |= 2;
+      }
+    }
+  #endif
+  
+  // the packet is on the wire until the PIO is done with its last byte
+  if(this->tx_pending && !this->busy && this->sent == this->packs[this->pack_tail % PS2OUT_PACKS].len) {
+    ps2out_hist_add(&this->bus, time_us_32() - this->tx_time);
+    this->tx_pending = false;
+  }
+  
+  // the gap starts when the PIO is done with a byte
+  if(this->busy) this->ready = time_us_64() + this->gap_us;
+  ps2out_next(this);
+  
+  restore_interrupts(irq);
+}
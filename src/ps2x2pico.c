@@ -23,10 +23,24 @@
  * THE SOFTWARE.
  *
  */
-#include "ps2x2pico.h"
+#include "hal_pico.h"
+#include "tusb.h"
 #include "bsp/board_api.h"
 #include "hardware/gpio.h"
 #include "hardware/watchdog.h"
+#include "pico/multicore.h"
+
+void core1_main() {
+  hal_core1_init();
+  kb_init(KBOUT, KBIN);
+  ms_init(MSOUT, MSIN);
+
+  while(1) {
+    hal_core1_task();
+    kb_task();
+    ms_task();
+  }
+}
 
 int main() {
   board_init();
@@ -41,13 +55,12 @@ int main() {
 
   tuh_hid_set_default_protocol(HID_PROTOCOL_REPORT);
   tusb_init();
-  kb_init(KBOUT, KBIN);
-  ms_init(MSOUT, MSIN);
+  hal_init();
+  multicore_launch_core1(core1_main);
 
   while(1) {
     tuh_task();
-    kb_task();
-    ms_task();
+    hal_core0_task();
   }
 }
 
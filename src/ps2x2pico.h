@@ -29,9 +29,7 @@
 #include <stdint.h>
 #include <string.h>
 
-#include "tusb.h"
-#include "hardware/pio.h"
-#include "pico/util/queue.h"
+#include "class/hid/hid.h"
 
 typedef int8_t s8;
 typedef int16_t s16;
@@ -45,44 +43,157 @@ typedef uint64_t u64;
 
 void kb_init(u8 gpio_out, u8 gpio_in);
 void kb_send_key(u8 key, bool is_key_pressed, u8 modifiers);
+void kb_sync(const u32* keys);
+bool kb_ready();
+extern u32 kb_overflows;
+extern u32 kb_resyncs;
 void tuh_kb_set_leds(u8 leds);
 bool kb_task();
 
 void ms_init(u8 gpio_out, u8 gpio_in);
-void ms_send_movement(u8 buttons, s8 x, s8 y, s8 z);
+// sources of mouse input, their buttons are combined and their movement added up
+enum { MS_USB, MS_PS2IN, MS_SOURCES };
+
+void ms_send_movement(u8 source, u8 buttons, s32 x, s32 y, s8 z);
 bool ms_task();
+extern u32 ms_clicks_lost;
 
+void usbin_mount(u8 dev_addr, u8 instance, u8 itf_protocol, u8 protocol, u16 vid, u16 pid, u8 const* desc_report, u16 desc_len);
+void usbin_umount(u8 dev_addr, u8 instance);
+void usbin_report(u8 dev_addr, u8 instance, u8 const* report, u16 len);
+void usbin_kb_state(u32* keys);
 
-u32 ps2_frame(u8 byte);
-typedef void (*rx_callback)(u8 byte, u8 prev_byte);
+// All timed work of the conversion core runs from one alarm, see sched.c.
+// A job is pending at most once, scheduling it again only moves it.
+// Callbacks return the µs until their next run, from the time they were due, or 0 to stop.
+enum { JOB_KB_REPEAT, JOB_KB_BLINK, JOB_MS_SEND, JOB_MS_RESET, JOB_COUNT };
+
+typedef s64 (*sched_callback)();
 
 typedef struct {
-  PIO pio;
-  uint sm;
-  queue_t qbytes;
-  queue_t qpacks;
-  rx_callback rx;
-  u8 last_rx;
-  u8 last_tx;
-  u8 sent;
-  u8 busy;
-} ps2out;
+  sched_callback callback;
+  bool pending;
+  u8 gen;
+  u64 due;
+  u32 runs;
+  u32 late_max; // how long after its due time the job ran
+  u64 late_sum;
+} sched_job;
 
-void ps2out_init(ps2out* this, PIO pio, u8 data_pin, rx_callback rx);
-void ps2out_task(ps2out* this);
+extern sched_job sched_jobs[JOB_COUNT];
+extern const char* const sched_names[JOB_COUNT];
 
+void sched_in_ms(u8 job, u32 ms, sched_callback callback);
+void sched_in_us(u8 job, u32 us, sched_callback callback);
+void sched_cancel(u8 job);
+void sched_run();
 
-typedef struct {
-  PIO pio;
-  uint sm;
-  u8 state;
-  u8 byte;
-} ps2in;
-
-void ps2in_init(ps2in* this, PIO pio, u8 data_pin);
-void ps2in_task(ps2in* this, ps2out* out);
-void ps2in_reset(ps2in* this);
-void ps2in_set(ps2in* this, u8 command, u8 byte);
+
+// Hardware abstraction layer, implemented by hal_pico.c for the RP2040
+// and by host/hal_host.c for native builds.
+#define PS2_KB 0
+#define PS2_MS 1
+
+typedef void (*rx_callback)(u8 byte, u8 prev_byte);
+
+void hal_ps2_init(u8 port, u8 gpio_out, u8 gpio_in, rx_callback rx);
+void hal_ps2_send(u8 port, u8 byte);
+bool hal_ps2_send_packet(u8 port, const u8* bytes, u8 len);
+u16 hal_ps2_room(u8 port);
+bool hal_ps2_busy(u8 port);
+void hal_ps2_expect(u8 port);
+void hal_ps2_clear(u8 port);
+void hal_ps2_task(u8 port);
+void hal_ps2in_reset(u8 port);
+void hal_ps2in_set(u8 port, u8 command, u8 byte);
+
+// hal_alarm_at() replaces the target of the one alarm, which calls sched_run().
+// hal_lock() keeps the alarm and the PS/2 interrupts out.
+void hal_alarm_at(u64 us);
+u32 hal_lock();
+void hal_unlock(u32 state);
+u64 hal_time_us();
+
+bool hal_hid_receive_report(u8 dev_addr, u8 instance);
+void hal_hid_set_leds(u8 dev_addr, u8 instance, u8* leds);
+void hal_led(bool on);
+
+// Hand-off between the USB side and the PS/2 side, which may run on different cores
+void hal_kb_key(u8 key, bool is_key_pressed, u8 modifiers);
+void hal_ms_movement(u8 buttons, s32 x, s32 y, s8 z);
+void hal_kb_leds(u8 leds);
+
+// Log messages are recorded as binary events and only formatted by the reader,
+// X(event, level, format) with one byte per format argument, %s lists all bytes.
+// Events above TRACE_LEVEL are compiled out.
+#define TRACE_OFF 0
+#define TRACE_WARN 1
+#define TRACE_INFO 2
+#define TRACE_BYTES 3
+
+#ifndef TRACE_LEVEL
+  #define TRACE_LEVEL TRACE_BYTES
+#endif
+
+#define TRACE_EVENTS(X) \
+  X(TR_DROPPED, TRACE_WARN, "WARNING: %u trace records dropped") \
+  X(TR_KB_TX, TRACE_BYTES, "kb > host %02x") \
+  X(TR_KB_TX_SEQ, TRACE_BYTES, "kb > host%s") \
+  X(TR_KB_RESEND, TRACE_BYTES, "r: k>h %x") \
+  X(TR_KB_RX, TRACE_BYTES, "host > kb %02x") \
+  X(TR_MS_TX, TRACE_BYTES, "ms > host %02x") \
+  X(TR_MS_RX, TRACE_BYTES, "host > ms %02x") \
+  X(TR_KB_BLINK, TRACE_INFO, "Blinking keyboard LEDs") \
+  X(TR_KB_SCS, TRACE_INFO, "scancodeset set to %u") \
+  X(TR_KB_DEFAULTS, TRACE_INFO, "Setting defaults for keyboard") \
+  X(TR_KB_IGNORED, TRACE_INFO, "INFO: Ignoring hid key 0x%x by design.") \
+  X(TR_KB_DISABLED, TRACE_WARN, "WARNING: Keyboard disabled, ignoring key press %u") \
+  X(TR_KB_UNMAPPED, TRACE_WARN, "WARNING: Unmapped HID key 0x%x in set %u, ignoring it!") \
+  X(TR_KB_SCS_UNKNOWN, TRACE_WARN, "WARNING: scancodeset requested to set to unknown value %u by host, defaulting to 2") \
+  X(TR_KB_NOT_SCS3, TRACE_WARN, "WARNING: Scan code set 3 not set. Ignoring command 0x%x") \
+  X(TR_KB_OVERFLOW, TRACE_WARN, "WARNING: PS/2 queue full at key 0x%x, resyncing key state") \
+  X(TR_KB_UNKNOWN_CMD, TRACE_WARN, "WARNING: Unknown host cmd: 0x%x, requesting resend from host!") \
+  X(TR_KB_CMD_RESET_FF, TRACE_INFO, "KBHOSTCMD_RESET_FF") \
+  X(TR_KB_CMD_RESEND_FE, TRACE_INFO, "KBHOSTCMD_RESEND_FE") \
+  X(TR_KB_CMD_SCS3_SET_KEY_MAKE_FD, TRACE_INFO, "KBHOSTCMD_SCS3_SET_KEY_MAKE_FD") \
+  X(TR_KB_CMD_SCS3_SET_KEY_MAKE_BREAK_FC, TRACE_INFO, "KBHOSTCMD_SCS3_SET_KEY_MAKE_BREAK_FC") \
+  X(TR_KB_CMD_SCS3_SET_KEY_MAKE_TYPEMATIC_FB, TRACE_INFO, "KBHOSTCMD_SCS3_SET_KEY_MAKE_TYPEMATIC_FB") \
+  X(TR_KB_CMD_SCS3_SET_ALL_MAKE_BREAK_TYPEMATIC_FA, TRACE_INFO, "KBHOSTCMD_SCS3_SET_ALL_MAKE_BREAK_TYPEMATIC_FA") \
+  X(TR_KB_CMD_SCS3_SET_ALL_MAKE_F9, TRACE_INFO, "KBHOSTCMD_SCS3_SET_ALL_MAKE_F9") \
+  X(TR_KB_CMD_SCS3_SET_ALL_MAKE_BREAK_F8, TRACE_INFO, "KBHOSTCMD_SCS3_SET_ALL_MAKE_BREAK_F8") \
+  X(TR_KB_CMD_SCS3_SET_ALL_MAKE_TYPEMATIC_F7, TRACE_INFO, "KBHOSTCMD_SCS3_SET_ALL_MAKE_TYPEMATIC_F7") \
+  X(TR_KB_CMD_SET_DEFAULT_F6, TRACE_INFO, "KBHOSTCMD_SET_DEFAULT_F6") \
+  X(TR_KB_CMD_DISABLE_F5, TRACE_INFO, "KBHOSTCMD_DISABLE_F5") \
+  X(TR_KB_CMD_ENABLE_F4, TRACE_INFO, "KBHOSTCMD_ENABLE_F4") \
+  X(TR_KB_CMD_SET_TYPEMATIC_PARAMS_F3, TRACE_INFO, "KBHOSTCMD_SET_TYPEMATIC_PARAMS_F3") \
+  X(TR_KB_CMD_READ_ID_F2, TRACE_INFO, "KBHOSTCMD_READ_ID_F2") \
+  X(TR_KB_CMD_SET_SCAN_CODE_SET_F0, TRACE_INFO, "KBHOSTCMD_SET_SCAN_CODE_SET_F0") \
+  X(TR_KB_CMD_ECHO_EE, TRACE_INFO, "KBHOSTCMD_ECHO_EE") \
+  X(TR_KB_CMD_SET_LEDS_ED, TRACE_INFO, "KBHOSTCMD_SET_LEDS_ED") \
+  X(TR_KB_REPORT_LEN, TRACE_WARN, "keyboard unknown  len: %02x")
+
+#define TRACE_ENUM(event, level, format) event,
+#define TRACE_LEVEL_ENUM(event, level, format) event##_LEVEL = level,
+enum { TRACE_EVENTS(TRACE_ENUM) TR_COUNT };
+enum { TRACE_EVENTS(TRACE_LEVEL_ENUM) };
+
+void hal_trace(u8 event, const u8* args, u8 len);
+void trace_format(char* buf, u16 size, u8 event, const u8* args, u8 len);
+
+#define trace0(event) do { \
+    if(event##_LEVEL <= TRACE_LEVEL) hal_trace(event, NULL, 0); \
+  } while(0)
+
+#define trace(event, ...) do { \
+    if(event##_LEVEL <= TRACE_LEVEL) { \
+      const u8 trace_args[] = { __VA_ARGS__ }; \
+      hal_trace(event, trace_args, sizeof(trace_args)); \
+    } \
+  } while(0)
+
+#define trace_bytes(event, bytes, len) do { \
+    if(event##_LEVEL <= TRACE_LEVEL) hal_trace(event, bytes, len); \
+  } while(0)
 
 
 #define KB_EXT_PFX_E0 0xe0 // This is the extended code prefix used in sets 1 and 2
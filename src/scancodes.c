@@ -25,7 +25,6 @@
  *
  */
 #include "ps2x2pico.h"
-#include "tusb.h"
 
 u8 const ext_code_keys_1_2[] = {
   HID_KEY_INSERT,
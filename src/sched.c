@@ -0,0 +1,103 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2024 No0ne (https://github.com/No0ne)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#include "ps2x2pico.h"
+
+sched_job sched_jobs[JOB_COUNT];
+const char* const sched_names[JOB_COUNT] = { "kb_repeat", "kb_blink", "ms_send", "ms_reset" };
+u64 sched_armed = 0;
+
+// Points the alarm at the earliest pending job, called with the lock held
+void sched_arm() {
+  u64 due = 0;
+  for(u8 i = 0; i < JOB_COUNT; i++) {
+    if(sched_jobs[i].pending && (!due || sched_jobs[i].due < due)) due = sched_jobs[i].due;
+  }
+
+  if(due && due != sched_armed) {
+    sched_armed = due;
+    hal_alarm_at(due);
+  }
+}
+
+void sched_in_us(u8 job, u32 us, sched_callback callback) {
+  u32 state = hal_lock();
+  sched_job* j = &sched_jobs[job];
+  j->callback = callback;
+  j->due = hal_time_us() + us;
+  j->pending = true;
+  j->gen++;
+  sched_arm();
+  hal_unlock(state);
+}
+
+void sched_in_ms(u8 job, u32 ms, sched_callback callback) {
+  sched_in_us(job, ms * 1000, callback);
+}
+
+void sched_cancel(u8 job) {
+  u32 state = hal_lock();
+  sched_jobs[job].pending = false;
+  sched_jobs[job].gen++;
+  hal_unlock(state);
+}
+
+// Runs every job that is due, earliest first and by job order on a tie
+void sched_run() {
+  u32 state = hal_lock();
+  sched_armed = 0;
+
+  while(1) {
+    u64 now = hal_time_us();
+    sched_job* j = NULL;
+    for(u8 i = 0; i < JOB_COUNT; i++) {
+      sched_job* c = &sched_jobs[i];
+      if(c->pending && c->due <= now && (!j || c->due < j->due)) j = c;
+    }
+    if(!j) break;
+
+    u32 late = now - j->due;
+    if(late > j->late_max) j->late_max = late;
+    j->late_sum += late;
+    j->runs++;
+
+    j->pending = false;
+    u8 gen = ++j->gen;
+    u64 due = j->due;
+
+    hal_unlock(state);
+    s64 next = j->callback();
+    state = hal_lock();
+
+    // unless the job was moved or cancelled meanwhile, a late run does not cause a burst of catch-up runs
+    if(next && j->gen == gen) {
+      j->due = due + next;
+      if(j->due < now) j->due = now;
+      j->pending = true;
+    }
+  }
+
+  sched_arm();
+  hal_unlock(state);
+}
@@ -56,7 +56,7 @@
 #define CFG_TUH_ENUMERATION_BUFSIZE 256
 
 #define CFG_TUH_HUB                 2
-#define CFG_TUH_DEVICE_MAX          6
+#define CFG_TUH_DEVICE_MAX          8
 
 #define CFG_TUH_HID                 16
 #define CFG_TUH_HID_EPIN_BUFSIZE    128 // default 64
@@ -25,65 +25,67 @@
  *
  */
 #include "ps2x2pico.h"
-#include "bsp/board_api.h"
 
-#define MAX_REPORT 4
-#define MAX_REPORT_ITEMS 32
-
-typedef struct {
-  u16 page;
-  u16 usage;
-} hid_usage_t;
-
-typedef struct {
-  u32 type;
-  u8 exponent;
-} hid_unit_t;
-
-typedef struct {
-  s32 min;
-  s32 max;
-} hid_minmax_t;
-
-typedef struct {
-  hid_usage_t usage;
-  hid_unit_t unit;
-  hid_minmax_t logical;
-  hid_minmax_t physical;
-} hid_report_item_attributes_t;
+#define MAX_REPORT 16 // reports per descriptor
+#define MAX_REPORT_ITEMS 256 // items per descriptor, shared by its reports
+#define MAX_ROUTES 32 // routed reports over all interfaces
 
+// only what the extraction plans need, about 12 bytes per item
 typedef struct {
   u16 bit_offset;
+  u16 usage_page;
+  u16 usage;
   u8 bit_size;
   u8 bit_count;
   u8 item_type;
-  u16 item_flags;
-  hid_report_item_attributes_t attributes;
+  u8 item_flags;
+  bool is_signed; // logical minimum below 0
 } hid_report_item_t;
 
 typedef struct {
   u8 report_id;
   u8 usage;
   u16 usage_page;
-  u8 num_items;
-  hid_report_item_t	item[MAX_REPORT_ITEMS];
+  u16 first_item; // in hid_report_items
+  u16 num_items;
 } hid_report_info_t;
 
+enum {
+  HID_FIELD_NONE,
+  HID_FIELD_U8,
+  HID_FIELD_S8,
+  HID_FIELD_U16,
+  HID_FIELD_S16,
+  HID_FIELD_BITS
+};
+
+// one report field reduced to what is needed to read it
 typedef struct {
-  const hid_report_item_t *x;
-  const hid_report_item_t *y;
-  const hid_report_item_t *z;
-  const hid_report_item_t *lb;
-  const hid_report_item_t *mb;
-  const hid_report_item_t *rb;
-  const hid_report_item_t *bw;
-  const hid_report_item_t *fw;
-} ms_items_t;
+  u8 kind;
+  u8 shift;
+  u8 size;
+  bool is_signed;
+  u16 byte;
+  u16 end; // report bytes needed to read the field
+} hid_field_t;
+
+// fields of one report, compiled at mount time
+typedef struct {
+  hid_field_t x;
+  hid_field_t y;
+  hid_field_t z;
+  hid_field_t buttons; // lb, rb, mb, bw, fw as one mask if contiguous
+  hid_field_t button[5];
+  hid_field_t modifiers;
+  u16 keys_byte;
+  u8 keys_count;
+  u16 nkro_byte;
+  u8 nkro_len;
+} hid_plan_t;
 
 u8 kb_leds = 0;
-u8 kb_modifiers = 0;
-u8 kb_keys[120] = {0};
-ms_items_t ms_items;
+u32 kb_state[8] = {0}; // keys held by any keyboard as a bitmap of hid usages, modifiers at 0xe0
+u8 kb_refs[256] = {0}; // number of keyboards holding each key
 //char device_str[50];
 //char manufacturer_str[50];
 
@@ -92,17 +94,46 @@ struct {
   u8 instance;
 } keyboards[8];
 
-struct {
-  u8 report_count;
-  hid_report_info_t report_info[MAX_REPORT];
-} hid_info[CFG_TUH_HID];
+typedef struct hid_itf hid_itf_t;
+typedef void (*hid_handler_t)(hid_itf_t* itf, hid_plan_t* plan, u8 const* report, u16 len);
+
+typedef struct {
+  hid_handler_t handler;
+  hid_plan_t plan;
+} hid_route_t;
+
+// one mounted HID interface, routed per report at mount time
+struct hid_itf {
+  u8 dev_addr;
+  u8 instance;
+  bool report_id;
+  u8 first_route; // in hid_routes
+  u8 route_count;
+  u8 route_by_id[256]; // route index + 1, 0 if the report is ignored
+  u32 keys[8]; // keys held on this interface, same layout as kb_state
+  u8 buttons; // mouse buttons held on this interface
+};
+
+#define MAX_DEV_ADDR (CFG_TUH_DEVICE_MAX + CFG_TUH_HUB)
+
+hid_itf_t hid_itf[CFG_TUH_HID];
+u8 hid_itf_by_addr[MAX_DEV_ADDR + 1][CFG_TUH_HID]; // hid_itf index + 1
+
+// routes of all interfaces, each interface owns a contiguous block
+hid_route_t hid_routes[MAX_ROUTES];
+u8 hid_routes_used = 0;
+
+// scratch space for the descriptor being mounted
+hid_report_info_t hid_report_info[MAX_REPORT];
+hid_report_item_t hid_report_items[MAX_REPORT_ITEMS];
 
 bool hid_parse_find_bit_item_by_page(hid_report_info_t* report_info_arr, u8 type, u16 page, u8 bit, const hid_report_item_t **item) {
-  for(u8 i = 0; i < report_info_arr->num_items; i++) {
-    if(report_info_arr->item[i].item_type == type && report_info_arr->item[i].attributes.usage.page == page) {
+  const hid_report_item_t* items = &hid_report_items[report_info_arr->first_item];
+  for(u16 i = 0; i < report_info_arr->num_items; i++) {
+    if(items[i].item_type == type && items[i].usage_page == page) {
       if(item) {
-        if(i+bit < report_info_arr->num_items && report_info_arr->item[i+bit].item_type == type && report_info_arr->item[i+bit].attributes.usage.page == page) {
-          *item = &report_info_arr->item[i + bit];
+        if(i+bit < report_info_arr->num_items && items[i+bit].item_type == type && items[i+bit].usage_page == page) {
+          *item = &items[i + bit];
         } else {
           return false;
         }
@@ -114,10 +145,11 @@ bool hid_parse_find_bit_item_by_page(hid_report_info_t* report_info_arr, u8 type
 }
 
 bool hid_parse_find_item_by_usage(hid_report_info_t* report_info_arr, u8 type, u16 usage, const hid_report_item_t **item) {
-  for(u8 i = 0; i < report_info_arr->num_items; i++) {
-    if(report_info_arr->item[i].item_type == type && report_info_arr->item[i].attributes.usage.usage == usage) {
+  const hid_report_item_t* items = &hid_report_items[report_info_arr->first_item];
+  for(u16 i = 0; i < report_info_arr->num_items; i++) {
+    if(items[i].item_type == type && items[i].usage == usage) {
       if(item) {
-        *item = &report_info_arr->item[i];
+        *item = &items[i];
       }
       return true;
     }
@@ -125,54 +157,6 @@ bool hid_parse_find_item_by_usage(hid_report_info_t* report_info_arr, u8 type, u
   return false;
 }
 
-bool hid_parse_get_item_value(const hid_report_item_t *item, const u8 *report, u8 len, s32 *value) {
-  (void)len;
-  if(item == NULL || report == NULL) return false;
-  u8 boffs = item->bit_offset & 0x07;
-  u8 pos = 8 - boffs;
-  u8 offs  = item->bit_offset >> 3;
-  u32 mask = ~(0xffffffff << item->bit_size);
-  s32 val = report[offs++] >> boffs;
-  while(item->bit_size > pos) {
-    val |= (report[offs++] << pos);
-    pos += 8;
-  }
-  val &= mask;
-  if(item->attributes.logical.min < 0) {
-    if(val & (1 << (item->bit_size - 1))) {
-      val |= (0xffffffff << item->bit_size);
-    }
-  }
-  *value = val;
-  return true;
-}
-
-s32 to_signed_value(const hid_report_item_t *item, const u8 *report, u16 len) {
-  s32 value = 0;
-  if(hid_parse_get_item_value(item, report, len, &value)) {
-    s32 midval = ((item->attributes.logical.max - item->attributes.logical.min) >> 1) + 1;
-    value -= midval;
-    value <<= (16 - item->bit_size);
-  }
-  if(value > 32767) value = 32767;
-  if(value < -32767) value = -32767;
-  return value;
-}
-
-s8 to_signed_value8(const hid_report_item_t *item, const u8 *report, u16 len) {
-  s32 value = 0;
-  if(hid_parse_get_item_value(item, report, len, &value)) {
-    value = (value > 127) ? 127 : (value < -127) ? -127 : value;
-  }
-  return value;
-}
-
-bool to_bit_value(const hid_report_item_t *item, const u8 *report, u16 len) {
-  s32 value = 0;
-  hid_parse_get_item_value(item, report, len, &value);
-  return value ? true : false;
-}
-
 u8 hid_parse_report_descriptor(hid_report_info_t* report_info_arr, u8 arr_count, u8 const* desc_report, u16 desc_len) {
   union TU_ATTR_PACKED {
     u8 byte;
@@ -183,19 +167,18 @@ u8 hid_parse_report_descriptor(hid_report_info_t* report_info_arr, u8 arr_count,
     };
   } header;
 
-  tu_memclr(report_info_arr, arr_count * sizeof(tuh_hid_report_info_t));
+  tu_memclr(report_info_arr, arr_count * sizeof(hid_report_info_t));
+  tu_memclr(hid_report_items, sizeof(hid_report_items));
 
   u8 report_num = 0;
   hid_report_info_t* info = report_info_arr;
 
   u16 ri_global_usage_page = 0;
   s32 ri_global_logical_min = 0;
-  s32 ri_global_logical_max = 0;
-  s32 ri_global_physical_min = 0;
-  s32 ri_global_physical_max = 0;
   u8 ri_report_count = 0;
   u8 ri_report_size = 0;
   u8 ri_report_usage_count = 0;
+  u16 ri_bit_offset[4] = {0}; // input, output, -, feature
 
   u8 ri_collection_depth = 0;
 
@@ -223,27 +206,29 @@ u8 hid_parse_report_descriptor(hid_report_info_t* report_info_arr, u8 arr_count,
           case RI_MAIN_INPUT:
           case RI_MAIN_OUTPUT:
           case RI_MAIN_FEATURE:
-            offset = (info->num_items == 0) ? 0 : (info->item[info->num_items - 1].bit_offset + info->item[info->num_items - 1].bit_size);
+            offset = ri_bit_offset[tag - RI_MAIN_INPUT];
             for(u8 i = 0; i < ri_report_count; i++) {
-              if(info->num_items + i < MAX_REPORT_ITEMS) {
-                info->item[info->num_items + i].bit_offset = offset;
-                info->item[info->num_items + i].bit_size = ri_report_size;
-                info->item[info->num_items + i].bit_count = ri_report_count;
-                info->item[info->num_items + i].item_type = tag;
-                info->item[info->num_items + i].attributes.logical.min = ri_global_logical_min;
-                info->item[info->num_items + i].attributes.logical.max = ri_global_logical_max;
-                info->item[info->num_items + i].attributes.physical.min = ri_global_physical_min;
-                info->item[info->num_items + i].attributes.physical.max = ri_global_physical_max;
-                info->item[info->num_items + i].attributes.usage.page = ri_global_usage_page;
+              u16 n = info->first_item + info->num_items + i;
+              if(n < MAX_REPORT_ITEMS) {
+                hid_report_item_t* item = &hid_report_items[n];
+                item->bit_offset = offset;
+                item->bit_size = ri_report_size;
+                item->bit_count = ri_report_count;
+                item->item_type = tag;
+                item->item_flags = data;
+                item->is_signed = ri_global_logical_min < 0;
+                item->usage_page = ri_global_usage_page;
                 if(ri_report_usage_count != ri_report_count && ri_report_usage_count > 0) {
                   if(i >= ri_report_usage_count) {
-                    info->item[info->num_items + i].attributes.usage = info->item[info->num_items + i - 1].attributes.usage;
+                    item->usage_page = item[-1].usage_page;
+                    item->usage = item[-1].usage;
                   }
                 }
               }
               offset += ri_report_size;
             }
-            info->num_items += ri_report_count;
+            ri_bit_offset[tag - RI_MAIN_INPUT] = offset;
+            info->num_items = (info->first_item + info->num_items + ri_report_count < MAX_REPORT_ITEMS) ? info->num_items + ri_report_count : MAX_REPORT_ITEMS - info->first_item;
             ri_report_usage_count = 0;
           break;
 
@@ -254,8 +239,11 @@ u8 hid_parse_report_descriptor(hid_report_info_t* report_info_arr, u8 arr_count,
           case RI_MAIN_COLLECTION_END:
             ri_collection_depth--;
             if(ri_collection_depth == 0) {
+              u16 next_item = info->first_item + info->num_items;
               info++;
               report_num++;
+              if(report_num < arr_count) info->first_item = next_item;
+              memset(ri_bit_offset, 0, sizeof(ri_bit_offset));
             }
           break;
         }
@@ -273,15 +261,6 @@ u8 hid_parse_report_descriptor(hid_report_info_t* report_info_arr, u8 arr_count,
           case RI_GLOBAL_LOGICAL_MIN:
             ri_global_logical_min = sdata;
           break;
-          case RI_GLOBAL_LOGICAL_MAX:
-            ri_global_logical_max = sdata;
-          break;
-          case RI_GLOBAL_PHYSICAL_MIN:
-            ri_global_physical_min = sdata;
-          break;
-          case RI_GLOBAL_PHYSICAL_MAX:
-            ri_global_physical_max = sdata;
-          break;
           case RI_GLOBAL_REPORT_ID:
             info->report_id = data;
           break;
@@ -299,8 +278,8 @@ u8 hid_parse_report_descriptor(hid_report_info_t* report_info_arr, u8 arr_count,
           if(ri_collection_depth == 0) {
             info->usage = data;
           } else {
-            if(ri_report_usage_count < MAX_REPORT_ITEMS) {
-              info->item[info->num_items + ri_report_usage_count].attributes.usage.usage = data;
+            if(info->first_item + info->num_items + ri_report_usage_count < MAX_REPORT_ITEMS) {
+              hid_report_items[info->first_item + info->num_items + ri_report_usage_count].usage = data;
               ri_report_usage_count++;
             }
           }
@@ -315,32 +294,115 @@ u8 hid_parse_report_descriptor(hid_report_info_t* report_info_arr, u8 arr_count,
   return report_num;
 }
 
-u8 hid_parse_keyboard_modifiers(hid_report_info_t* report_info_arr, const u8 *report, u8 len) {
-  u8 modifiers = 0;
-  u8 bit = 0;
-  for(u8 i = 0; i < report_info_arr->num_items; i++) {
-    if(report_info_arr->item[i].item_type == RI_MAIN_INPUT &&
-       report_info_arr->item[i].attributes.usage.page == HID_USAGE_PAGE_KEYBOARD &&
-       report_info_arr->item[i].bit_size == 1 &&
-       report_info_arr->item[i].bit_count == 8) {
-      modifiers |= to_bit_value(&report_info_arr->item[i], report, len) << bit;
-      bit++;
-      if(bit == 8) break;
+const hid_report_item_t* hid_parse_find_keyboard_item(hid_report_info_t* report_info_arr, u8 bit_size, u8 min_count) {
+  for(u16 i = 0; i < report_info_arr->num_items; i++) {
+    const hid_report_item_t* item = &hid_report_items[report_info_arr->first_item + i];
+    if(item->item_type == RI_MAIN_INPUT &&
+       item->usage_page == HID_USAGE_PAGE_KEYBOARD &&
+       !(item->item_flags & HID_CONSTANT) &&
+       item->bit_size == bit_size &&
+       item->bit_count >= min_count) {
+      return item;
     }
   }
-  return modifiers;
+  return NULL;
 }
 
-bool hid_parse_keyboard_is_nkro(hid_report_info_t* report_info_arr) {
-  for(u8 i = 0; i < report_info_arr->num_items; i++) {
-    if(report_info_arr->item[i].item_type == RI_MAIN_INPUT &&
-       report_info_arr->item[i].attributes.usage.page == HID_USAGE_PAGE_KEYBOARD &&
-       report_info_arr->item[i].bit_size == 1 &&
-       report_info_arr->item[i].bit_count >= 32) {
-      return true;
+void hid_field_compile(hid_field_t* f, u16 bit_offset, u8 bit_size, bool is_signed) {
+  if(bit_size == 0 || bit_size > 32) return;
+
+  f->byte = bit_offset >> 3;
+  f->shift = bit_offset & 7;
+  f->size = bit_size;
+  f->is_signed = is_signed;
+  f->end = (bit_offset + bit_size + 7) >> 3;
+
+  if(f->shift == 0 && bit_size == 8) {
+    f->kind = is_signed ? HID_FIELD_S8 : HID_FIELD_U8;
+  } else if(f->shift == 0 && bit_size == 16) {
+    f->kind = is_signed ? HID_FIELD_S16 : HID_FIELD_U16;
+  } else {
+    f->kind = HID_FIELD_BITS;
+  }
+}
+
+void hid_field_compile_item(hid_field_t* f, const hid_report_item_t* item) {
+  hid_field_compile(f, item->bit_offset, item->bit_size, item->is_signed);
+}
+
+s32 hid_field_get(const hid_field_t* f, const u8* report, u16 len) {
+  if(f->end > len) return 0;
+  const u8* p = &report[f->byte];
+
+  switch(f->kind) {
+    case HID_FIELD_U8:  return p[0];
+    case HID_FIELD_S8:  return (s8)p[0];
+    case HID_FIELD_U16: return p[0] | p[1] << 8;
+    case HID_FIELD_S16: return (s16)(p[0] | p[1] << 8);
+    case HID_FIELD_BITS: {
+      u64 bits = 0;
+      for(u8 i = 0; i < f->end - f->byte; i++) {
+        bits |= (u64)p[i] << (i * 8);
+      }
+      u32 val = (bits >> f->shift) & (0xffffffff >> (32 - f->size));
+      if(f->is_signed && f->size < 32 && val >> (f->size - 1)) {
+        val |= 0xffffffff << f->size;
+      }
+      return val;
     }
   }
-  return false;
+
+  return 0;
+}
+
+void hid_plan_compile(hid_plan_t* plan, hid_report_info_t* info) {
+  const hid_report_item_t* item;
+  memset(plan, 0, sizeof(hid_plan_t));
+
+  if(hid_parse_find_item_by_usage(info, RI_MAIN_INPUT, HID_USAGE_DESKTOP_X, &item)) hid_field_compile_item(&plan->x, item);
+  if(hid_parse_find_item_by_usage(info, RI_MAIN_INPUT, HID_USAGE_DESKTOP_Y, &item)) hid_field_compile_item(&plan->y, item);
+  if(hid_parse_find_item_by_usage(info, RI_MAIN_INPUT, HID_USAGE_DESKTOP_WHEEL, &item)) hid_field_compile_item(&plan->z, item);
+
+  // buttons that are a run of single bits are read with one mask
+  u16 first = 0;
+  u8 packed = 0;
+
+  for(u8 i = 0; i < 5; i++) {
+    if(!hid_parse_find_bit_item_by_page(info, RI_MAIN_INPUT, HID_USAGE_PAGE_BUTTON, i, &item)) continue;
+    hid_field_compile(&plan->button[i], item->bit_offset, item->bit_size, false);
+
+    if(i == 0) first = item->bit_offset;
+    if(packed == i && item->bit_size == 1 && item->bit_offset == first + i) packed++;
+  }
+
+  for(u8 i = packed; i < 5; i++) {
+    if(plan->button[i].kind != HID_FIELD_NONE) packed = 0;
+  }
+
+  if(packed) hid_field_compile(&plan->buttons, first, packed, false);
+
+  // keyboard modifiers, else the first byte
+  item = hid_parse_find_keyboard_item(info, 1, 8);
+  if(item && item->bit_count == 8) {
+    hid_field_compile(&plan->modifiers, item->bit_offset, 8, false);
+  } else {
+    hid_field_compile(&plan->modifiers, 0, 8, false);
+  }
+
+  // key array, left empty to fall back to the report length
+  item = hid_parse_find_keyboard_item(info, 8, 1);
+  if(item && !(item->item_flags & HID_VARIABLE) && (item->bit_offset & 7) == 0) {
+    plan->keys_byte = item->bit_offset >> 3;
+    plan->keys_count = item->bit_count;
+  }
+
+  // nkro bitmap, usages counted from 0 at its first bit
+  item = hid_parse_find_keyboard_item(info, 1, 32);
+  if(item) {
+    plan->nkro_byte = item->bit_offset >> 3;
+    plan->nkro_len = item->bit_count >> 3;
+    if(plan->nkro_len > sizeof(kb_state)) plan->nkro_len = sizeof(kb_state);
+  }
 }
 
 /*void convert_utf16le_to_utf8(const u16 *utf16, size_t utf16_len, u8 *utf8, size_t utf8_len) {
@@ -390,120 +452,186 @@ void print_utf16(u16 *temp_buf, size_t buf_len) {
   printf("%s", (char*)temp_buf);
 }*/
 
-void ms_setup(hid_report_info_t *info) {
-  ms_items_t *items = &ms_items;
-  memset(items, 0, sizeof(ms_items_t));
-  hid_parse_find_item_by_usage(info, RI_MAIN_INPUT, HID_USAGE_DESKTOP_X, &items->x);
-  hid_parse_find_item_by_usage(info, RI_MAIN_INPUT, HID_USAGE_DESKTOP_Y, &items->y);
-  hid_parse_find_item_by_usage(info, RI_MAIN_INPUT, HID_USAGE_DESKTOP_WHEEL, &items->z);
-  hid_parse_find_bit_item_by_page(info, RI_MAIN_INPUT, HID_USAGE_PAGE_BUTTON, 0, &items->lb);
-  hid_parse_find_bit_item_by_page(info, RI_MAIN_INPUT, HID_USAGE_PAGE_BUTTON, 1, &items->rb);
-  hid_parse_find_bit_item_by_page(info, RI_MAIN_INPUT, HID_USAGE_PAGE_BUTTON, 2, &items->mb);
-  hid_parse_find_bit_item_by_page(info, RI_MAIN_INPUT, HID_USAGE_PAGE_BUTTON, 3, &items->bw);
-  hid_parse_find_bit_item_by_page(info, RI_MAIN_INPUT, HID_USAGE_PAGE_BUTTON, 4, &items->fw);
+s8 ms_wheel_value(const hid_field_t* f, u8 const* report, u16 len) {
+  s32 value = hid_field_get(f, report, len);
+  return (value > 127) ? 127 : (value < -127) ? -127 : value;
+}
+
+// the host sees the buttons of all mice combined, and their movement added up
+void ms_movement(hid_itf_t* itf, u8 buttons, s32 x, s32 y, s8 z) {
+  itf->buttons = buttons;
+  buttons = 0;
+  for(u8 i = 0; i < CFG_TUH_HID; i++) {
+    if(hid_itf[i].dev_addr) buttons |= hid_itf[i].buttons;
+  }
+  hal_ms_movement(buttons, x, y, z);
 }
 
-void ms_report_receive(u8 const* report, u16 len) {
-  ms_items_t *items = &ms_items;
+void ms_report_receive(hid_itf_t* itf, hid_plan_t* plan, u8 const* report, u16 len) {
   u8 buttons = 0;
-  s8 x, y, z;
+  s32 x, y;
+  s8 z;
 
-  if(to_bit_value(items->lb, report, len)) buttons |= 0x01;
-  if(to_bit_value(items->rb, report, len)) buttons |= 0x02;
-  if(to_bit_value(items->mb, report, len)) buttons |= 0x04;
-  if(to_bit_value(items->bw, report, len)) buttons |= 0x08;
-  if(to_bit_value(items->fw, report, len)) buttons |= 0x10;
+  if(plan->buttons.kind != HID_FIELD_NONE) {
+    buttons = hid_field_get(&plan->buttons, report, len);
+  } else {
+    for(u8 i = 0; i < 5; i++) {
+      if(hid_field_get(&plan->button[i], report, len)) buttons |= 1 << i;
+    }
+  }
 
-  x = to_signed_value8(items->x, report, len);
-  y = to_signed_value8(items->y, report, len);
-  z = to_signed_value8(items->z, report, len);
+  // X and Y at full resolution, ps2ms scales them down to PS/2 counts
+  x = hid_field_get(&plan->x, report, len);
+  y = hid_field_get(&plan->y, report, len);
+  z = ms_wheel_value(&plan->z, report, len);
 
-  ms_send_movement(buttons, x, y, z);
+  ms_movement(itf, buttons, x, y, z);
 }
 
-void kb_report_receive(u8 modifiers, u8 const* report, u16 len) {
-  if(modifiers != kb_modifiers) {
-    // modifiers have changed
-    u8 rbits = modifiers;
-    u8 pbits = kb_modifiers;
+// the host sees the first make and the last break of a key held on several keyboards
+void kb_ref(u8 key, bool is_key_pressed) {
+  if(is_key_pressed) {
+    if(kb_refs[key]++) return;
+    kb_state[key >> 5] |= 1u << (key & 31);
+  } else {
+    if(!kb_refs[key] || --kb_refs[key]) return;
+    kb_state[key >> 5] &= ~(1u << (key & 31));
+  }
 
-    for(u8 j = 0; j < 8; j++) {
-      if((rbits & 1) != (pbits & 1)) {
-        kb_send_key(HID_KEY_CONTROL_LEFT + j, rbits & 1, modifiers);
-      }
+  hal_kb_key(key, is_key_pressed, kb_state[7] & 0xff);
+}
 
-      rbits = rbits >> 1;
-      pbits = pbits >> 1;
+// keys held by all keyboards together, for a resync after changes were dropped
+void usbin_kb_state(u32* keys) {
+  memcpy(keys, kb_state, sizeof(kb_state));
+}
+
+void kb_report_receive(hid_itf_t* itf, u8 modifiers, u32* keys) {
+  keys[0] &= ~1; // usage 0 is no key
+  keys[7] |= modifiers;
+
+  // modifiers first, so a shifted key is made after its shift
+  u32 changed = (keys[7] ^ itf->keys[7]) & 0xff;
+  while(changed) {
+    u8 bit = __builtin_ctz(changed);
+    kb_ref(HID_KEY_CONTROL_LEFT + bit, keys[7] >> bit & 1);
+    changed &= changed - 1;
+  }
+
+  // then breaks before makes
+  for(u8 w = 0; w < 8; w++) {
+    u32 released = itf->keys[w] & ~keys[w];
+    if(w == 7) released &= ~0xff;
+    while(released) {
+      kb_ref(w * 32 + __builtin_ctz(released), false);
+      released &= released - 1;
     }
+  }
 
-    kb_modifiers = modifiers;
+  for(u8 w = 0; w < 8; w++) {
+    u32 pressed = keys[w] & ~itf->keys[w];
+    if(w == 7) pressed &= ~0xff;
+    while(pressed) {
+      kb_ref(w * 32 + __builtin_ctz(pressed), true);
+      pressed &= pressed - 1;
+    }
   }
 
-  // go over activated non-modifier keys in prev_rpt and
-  // check if they are still in the current report
-  for(u8 i = 0; i < len; i++) {
-    if(kb_keys[i]) {
-      bool brk = true;
+  memcpy(itf->keys, keys, sizeof(itf->keys));
+}
 
-      for(u8 j = 0; j < len; j++) {
-        if(kb_keys[i] == report[j]) {
-          brk = false;
-          break;
-        }
-      }
+void kb_array_receive(hid_itf_t* itf, u8 modifiers, u8 const* report, u16 len) {
+  u32 keys[8] = {0};
+  for(u16 i = 0; i < len; i++) {
+    keys[report[i] >> 5] |= 1u << (report[i] & 31);
+  }
+  kb_report_receive(itf, modifiers, keys);
+}
 
-      if(brk) {
-        // send break if key not pressed anymore
-        kb_send_key(kb_keys[i], false, modifiers);
-      }
-    }
+void kb_boot_receive(hid_itf_t* itf, hid_plan_t* plan, u8 const* report, u16 len) {
+  (void)plan;
+  if(len < 8) return;
+  kb_array_receive(itf, report[0], report + 2, 6);
+}
+
+void kb_keys_receive(hid_itf_t* itf, hid_plan_t* plan, u8 const* report, u16 len) {
+  u8 modifiers = hid_field_get(&plan->modifiers, report, len);
+
+  if(plan->keys_count && plan->keys_byte < len) {
+    u16 count = len - plan->keys_byte;
+    if(count > plan->keys_count) count = plan->keys_count;
+    kb_array_receive(itf, modifiers, report + plan->keys_byte, count);
+
+  } else if(len == 7) {
+    kb_array_receive(itf, modifiers, report + 1, 6);
+
+  } else if(len == 8 || len == 9) {
+    kb_array_receive(itf, modifiers, report + 2, 6);
+
+  } else {
+    trace(TR_KB_REPORT_LEN, len > 0xff ? 0xff : len);
   }
+}
 
-  // go over activated non-modifier keys in report and check if they were
-  // already in prev_rpt.
-  for(u8 i = 0; i < len; i++) {
-    if(report[i]) {
-      bool make = true;
+void kb_nkro_receive(hid_itf_t* itf, hid_plan_t* plan, u8 const* report, u16 len) {
+  u8 modifiers = hid_field_get(&plan->modifiers, report, len);
+  u32 keys[8] = {0};
 
-      for(u8 j = 0; j < len; j++) {
-        if(report[i] == kb_keys[j]) {
-          make = false;
-          break;
-        }
-      }
+  // the bitmap is used as is, usage n is bit n
+  for(u16 i = 0; i < plan->nkro_len && plan->nkro_byte + i < len; i++) {
+    keys[i >> 2] |= (u32)report[plan->nkro_byte + i] << ((i & 3) * 8);
+  }
 
-      // send make if key was in the current report the first time
-      if(make) {
-        kb_send_key(report[i], true, modifiers);
-      }
-    }
+  kb_report_receive(itf, modifiers, keys);
+}
+
+void ms_boot_receive(hid_itf_t* itf, hid_plan_t* plan, u8 const* report, u16 len) {
+  (void)plan;
+  if(len < 3) return;
+  ms_movement(itf, report[0], (s8)report[1], (s8)report[2], len > 3 ? report[3] : 0);
+}
+
+hid_handler_t hid_route_handler(hid_report_info_t* info, hid_plan_t* plan) {
+  if(info->usage_page == HID_USAGE_PAGE_DESKTOP && info->usage == HID_USAGE_DESKTOP_MOUSE) {
+    return ms_report_receive;
   }
 
-  memset(kb_keys, 0, sizeof(kb_keys));
-  memcpy(kb_keys, report, len);
+  if(info->usage_page == HID_USAGE_PAGE_DESKTOP && info->usage == HID_USAGE_DESKTOP_KEYBOARD) {
+    return plan->nkro_len ? kb_nkro_receive : kb_keys_receive;
+  }
+
+  return NULL;
+}
+
+hid_itf_t* hid_itf_get(u8 dev_addr, u8 instance) {
+  if(dev_addr > MAX_DEV_ADDR || instance >= CFG_TUH_HID) return NULL;
+  u8 index = hid_itf_by_addr[dev_addr][instance];
+  return index ? &hid_itf[index - 1] : NULL;
 }
 
 void tuh_kb_set_leds(u8 leds) {
   for(u8 i = 0; i < 8; i++) {
     if(keyboards[i].dev_addr != 0) {
       kb_leds = leds;
-      tuh_hid_set_report(keyboards[i].dev_addr, keyboards[i].instance, 0, HID_REPORT_TYPE_OUTPUT, &kb_leds, sizeof(kb_leds));
+      hal_hid_set_leds(keyboards[i].dev_addr, keyboards[i].instance, &kb_leds);
     }
   }
 }
 
-void tuh_hid_mount_cb(u8 dev_addr, u8 instance, u8 const* desc_report, u16 desc_len) {
-  // This happens if report descriptor length > CFG_TUH_ENUMERATION_BUFSIZE.
-  // Consider increasing #define CFG_TUH_ENUMERATION_BUFSIZE 256 in tusb_config.h
-  if(desc_report == NULL && desc_len == 0) {
-    printf("WARNING: HID(%d,%d) skipped!\n", dev_addr, instance);
-    return;
+// gives back the interface's block and closes the gap
+void hid_routes_free(hid_itf_t* itf) {
+  u8 end = itf->first_route + itf->route_count;
+  memmove(&hid_routes[itf->first_route], &hid_routes[end], (hid_routes_used - end) * sizeof(hid_route_t));
+  hid_routes_used -= itf->route_count;
+
+  for(u8 i = 0; i < CFG_TUH_HID; i++) {
+    if(hid_itf[i].dev_addr && hid_itf[i].first_route >= end) hid_itf[i].first_route -= itf->route_count;
   }
 
-  hid_interface_protocol_enum_t hid_if_proto = tuh_hid_interface_protocol(dev_addr, instance);
-  u16 vid, pid;
-  tuh_vid_pid_get(dev_addr, &vid, &pid);
+  itf->route_count = 0;
+}
 
+void usbin_mount(u8 dev_addr, u8 instance, u8 hid_if_proto, u8 protocol, u16 vid, u16 pid, u8 const* desc_report, u16 desc_len) {
   char* hidprotostr = "none";
   if(hid_if_proto == HID_ITF_PROTOCOL_KEYBOARD) hidprotostr = "keyboard";
   if(hid_if_proto == HID_ITF_PROTOCOL_MOUSE) hidprotostr = "mouse";
@@ -511,8 +639,73 @@ void tuh_hid_mount_cb(u8 dev_addr, u8 instance, u8 const* desc_report, u16 desc_
   printf("\nHID(%d,%d,%s) mounted\n", dev_addr, instance, hidprotostr);
   printf(" VID: %04x  PID: %04x\n", vid, pid);
 
-  hid_info[instance].report_count = hid_parse_report_descriptor(hid_info[instance].report_info, MAX_REPORT, desc_report, desc_len);
-  printf(" HID has %u reports\n", hid_info[instance].report_count);
+  hid_itf_t* itf = NULL;
+  for(u8 i = 0; i < CFG_TUH_HID; i++) {
+    if(hid_itf[i].dev_addr == 0) {
+      itf = &hid_itf[i];
+      break;
+    }
+  }
+
+  if(!itf || dev_addr > MAX_DEV_ADDR || instance >= CFG_TUH_HID) {
+    printf(" ERROR: No room for HID(%d,%d,%s)!\n", dev_addr, instance, hidprotostr);
+    return;
+  }
+
+  memset(itf, 0, sizeof(hid_itf_t));
+  itf->dev_addr = dev_addr;
+  itf->instance = instance;
+  itf->first_route = hid_routes_used;
+  hid_itf_by_addr[dev_addr][instance] = itf - hid_itf + 1;
+
+  u8 report_count = hid_parse_report_descriptor(hid_report_info, MAX_REPORT, desc_report, desc_len);
+  printf(" HID has %u reports\n", report_count);
+
+  bool is_keyboard = false;
+
+  if(protocol == HID_PROTOCOL_BOOT) {
+    // boot reports have a fixed layout and no report id
+    hid_handler_t handler = NULL;
+    if(hid_if_proto == HID_ITF_PROTOCOL_KEYBOARD) handler = kb_boot_receive;
+    if(hid_if_proto == HID_ITF_PROTOCOL_MOUSE) handler = ms_boot_receive;
+
+    if(handler && hid_routes_used < MAX_ROUTES) {
+      hid_routes[itf->first_route].handler = handler;
+      itf->route_count = 1;
+      itf->route_by_id[0] = 1;
+      is_keyboard = handler == kb_boot_receive;
+    }
+
+  } else {
+    itf->report_id = !(report_count == 1 && hid_report_info[0].report_id == 0);
+
+    for(u8 i = 0; i < report_count; i++) {
+      hid_report_info_t* info = &hid_report_info[i];
+
+      if(itf->first_route + itf->route_count >= MAX_ROUTES) {
+        printf(" ERROR: No room for report %u!\n", info->report_id);
+        break;
+      }
+
+      hid_route_t* route = &hid_routes[itf->first_route + itf->route_count];
+
+      hid_plan_compile(&route->plan, info);
+      route->handler = hid_route_handler(info, &route->plan);
+
+      if(!route->handler) {
+        printf(" report %u unknown  usage_page: %02x  usage: %02x\n", info->report_id, info->usage_page, info->usage);
+        continue;
+      }
+
+      if(itf->route_by_id[info->report_id] == 0) {
+        itf->route_by_id[info->report_id] = ++itf->route_count;
+      }
+
+      if(route->handler != ms_report_receive) is_keyboard = true;
+    }
+  }
+
+  hid_routes_used += itf->route_count;
 
   /*u16 temp_buf[128];
 
@@ -528,11 +721,11 @@ void tuh_hid_mount_cb(u8 dev_addr, u8 instance, u8 const* desc_report, u16 desc_
   }
   printf("\n\n");*/
 
-  if(!tuh_hid_receive_report(dev_addr, instance)) {
+  if(!hal_hid_receive_report(dev_addr, instance)) {
     printf(" ERROR: Could not register for HID(%d,%d,%s)!\n", dev_addr, instance, hidprotostr);
   } else {
     printf(" HID(%d,%d,%s) registered for reports\n", dev_addr, instance, hidprotostr);
-    if(hid_if_proto == HID_ITF_PROTOCOL_KEYBOARD) {
+    if(is_keyboard) {
       for(u8 i = 0; i < 8; i++) {
         if(keyboards[i].dev_addr == 0 && keyboards[i].instance == 0) {
           keyboards[i].dev_addr = dev_addr;
@@ -541,13 +734,25 @@ void tuh_hid_mount_cb(u8 dev_addr, u8 instance, u8 const* desc_report, u16 desc_
         }
       }
     }
-    board_led_write(1);
+    hal_led(1);
   }
 }
 
-void tuh_hid_umount_cb(u8 dev_addr, u8 instance) {
+void usbin_umount(u8 dev_addr, u8 instance) {
   printf("HID(%d,%d) unmounted\n", dev_addr, instance);
-  board_led_write(0);
+  hal_led(0);
+
+  hid_itf_t* itf = hid_itf_get(dev_addr, instance);
+  if(itf) {
+    // release whatever was held, so no key stays down on the host
+    u32 none[8] = {0};
+    kb_report_receive(itf, 0, none);
+    if(itf->buttons) ms_movement(itf, 0, 0, 0, 0);
+
+    hid_routes_free(itf);
+    itf->dev_addr = 0;
+    hid_itf_by_addr[dev_addr][instance] = 0;
+  }
 
   for(u8 i = 0; i < 8; i++) {
     if(keyboards[i].dev_addr == dev_addr && keyboards[i].instance == instance) {
@@ -558,83 +763,22 @@ void tuh_hid_umount_cb(u8 dev_addr, u8 instance) {
   }
 }
 
-void tuh_hid_report_received_cb(u8 dev_addr, u8 instance, u8 const* report, u16 len) {
-  hid_report_info_t* rpt_info_arr = hid_info[instance].report_info;
-  hid_report_info_t* rpt_info = NULL;
+void usbin_report(u8 dev_addr, u8 instance, u8 const* report, u16 len) {
+  hid_itf_t* itf = hid_itf_get(dev_addr, instance);
+  if(!itf) return;
 
-  if(hid_info[instance].report_count == 1 && rpt_info_arr[0].report_id == 0) {
-    rpt_info = &rpt_info_arr[0];
-  } else {
-    u8 const rpt_id = report[0];
-    for(u8 i = 0; i < hid_info[instance].report_count; i++) {
-      if(rpt_id == rpt_info_arr[i].report_id) {
-        rpt_info = &rpt_info_arr[i];
-        break;
-      }
-    }
+  u8 index;
+  if(itf->report_id) {
+    if(len == 0) return;
+    index = itf->route_by_id[report[0]];
     report++;
     len--;
-  }
-
-  if(!rpt_info) return;
-
-  if(tuh_hid_interface_protocol(dev_addr, instance) == HID_ITF_PROTOCOL_MOUSE) {
-
-    if(tuh_hid_get_protocol(dev_addr, instance) == HID_PROTOCOL_BOOT) {
-      ms_send_movement(report[0], report[1], report[2], report[3]);
-
-    } else if(rpt_info->usage_page == HID_USAGE_PAGE_DESKTOP && rpt_info->usage == HID_USAGE_DESKTOP_MOUSE) {
-      ms_setup(rpt_info);
-      ms_report_receive(report, len);
-
-    } else {
-      printf("mouse unknown  usage_page: %02x  usage: %02x\n", rpt_info->usage_page, rpt_info->usage);
-    }
-
   } else {
-    u8 modifiers = report[0];
-
-    if(tuh_hid_get_protocol(dev_addr, instance) == HID_PROTOCOL_BOOT) {
-      report++; report++;
-      kb_report_receive(modifiers, report, 6);
-
-    } else if(rpt_info->usage_page == HID_USAGE_PAGE_DESKTOP && rpt_info->usage == HID_USAGE_DESKTOP_KEYBOARD) {
-      //u8 modifiers = hid_parse_keyboard_modifiers(rpt_info, report, len);
-
-      if(hid_parse_keyboard_is_nkro(rpt_info)) {
-        u8 current_key = 0;
-        u8 newreport[sizeof(kb_keys)] = {0};
-        u8 newindex = 0;
-
-        for(u8 i = 1; i < len && i < 16; i++) {
-          for(u8 j = 0; j < 8; j++) {
-            if(report[i] >> j & 1 && newindex < sizeof(kb_keys)) {
-              newreport[newindex] = current_key;
-              newindex++;
-            }
-            current_key++;
-          }
-        }
-
-        kb_report_receive(modifiers, newreport, sizeof(kb_keys));
-
-      } else if(len == 7) {
-        report++;
-        kb_report_receive(modifiers, report, 6);
-
-      } else if(len == 8 || len == 9) {
-        report++; report++;
-        kb_report_receive(modifiers, report, 6);
-
-      } else {
-        printf("keyboard unknown  len: %02x\n", len);
-      }
-
-    } else {
-      printf("keyboard unknown  usage_page: %02x  usage: %02x\n", rpt_info->usage_page, rpt_info->usage);
-    }
-
+    index = itf->route_by_id[0];
   }
 
-  tuh_hid_receive_report(dev_addr, instance);
+  if(!index) return;
+
+  hid_route_t* route = &hid_routes[itf->first_route + index - 1];
+  route->handler(itf, &route->plan, report, len);
 }